@@ -0,0 +1,120 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#include "clock_source.h"
+
+#include <algorithm>
+
+ClockSource* ClockSource::system()
+{
+	static SystemClock clock_system;
+	return &clock_system;
+}
+
+void SystemClock::wait_until(condition_variable& cv, unique_lock<mutex>& lock,
+                             steady_clock::time_point t)
+{
+	if (t == steady_clock::time_point::max())
+		cv.wait(lock); //wait_until() may overflow
+	else
+		cv.wait_until(lock, t);
+}
+
+/*------------------------------ VirtualClock ------------------------------*/
+
+VirtualClock::VirtualClock():
+	t_now(steady_clock::time_point() + hours(24)) {}
+
+steady_clock::time_point VirtualClock::now() const
+{
+	lock_guard<mutex> lock(mtx);
+	return t_now;
+}
+
+void VirtualClock::sleep_until(steady_clock::time_point t)
+{
+	unique_lock<mutex> lock_clock(mtx);
+	if (t <= t_now) return;
+	
+	Waiter w = {t, NULL, false};
+	block(&w, lock_clock);
+}
+
+void VirtualClock::wait_until(condition_variable& cv, unique_lock<mutex>& lock,
+                              steady_clock::time_point t)
+{
+	// the waiter is registered before the caller's lock is released, so a notification
+	// sent after the condition is changed under that lock can't be lost.
+	unique_lock<mutex> lock_clock(mtx);
+	if (t <= t_now) return;
+	
+	Waiter w = {t, &cv, false};
+	lock.unlock();
+	block(&w, lock_clock);
+	lock_clock.unlock();
+	lock.lock();
+}
+
+void VirtualClock::notify_one(condition_variable& cv)
+{
+	lock_guard<mutex> lock(mtx);
+	wake(&cv, false);
+}
+
+void VirtualClock::notify_all(condition_variable& cv)
+{
+	lock_guard<mutex> lock(mtx);
+	wake(&cv, true);
+}
+
+void VirtualClock::add_thread()
+{
+	lock_guard<mutex> lock(mtx);
+	cnt_threads++;
+}
+
+void VirtualClock::remove_thread()
+{
+	lock_guard<mutex> lock(mtx);
+	if (cnt_threads > 0) cnt_threads--;
+	advance(); //the others may be waiting for it
+}
+
+// mtx is locked. a woken waiter is removed by the thread waking it, so it is counted
+// as running before the time can move on.
+void VirtualClock::block(Waiter* w, unique_lock<mutex>& lock_clock)
+{
+	waiters.push_back(w);
+	advance();
+	while (! w->woken)
+		cv_clock.wait(lock_clock);
+}
+
+void VirtualClock::advance()
+{
+	if (cnt_threads == 0 || waiters.size() < cnt_threads) return;
+	
+	steady_clock::time_point t_next = steady_clock::time_point::max();
+	for (Waiter* w : waiters)
+		if (w->t < t_next) t_next = w->t;
+	if (t_next == steady_clock::time_point::max()) return; //nothing will happen
+	if (t_next > t_now) t_now = t_next;
+	
+	auto it = remove_if(waiters.begin(), waiters.end(), [this](Waiter* w) {
+		if (w->t > t_now) return false;
+		w->woken = true; return true;
+	});
+	waiters.erase(it, waiters.end());
+	cv_clock.notify_all();
+}
+
+void VirtualClock::wake(const condition_variable* cv, bool all)
+{
+	bool found = false;
+	auto it = remove_if(waiters.begin(), waiters.end(), [&](Waiter* w) {
+		if (w->cv != cv || (found && !all)) return false;
+		w->woken = found = true; return true;
+	});
+	waiters.erase(it, waiters.end());
+	if (found) cv_clock.notify_all();
+}
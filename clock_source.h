@@ -0,0 +1,132 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef CLOCK_SOURCE_H
+#define CLOCK_SOURCE_H
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// all timing of CommLayer and ChargeControlLayer goes through a ClockSource: reading the time,
+// sleeping and waiting on condition variables. ClockSource::system() is the real clock;
+// VirtualClock lets the control stack run with a simulated device faster than real time.
+class ClockSource
+{
+public:
+	static ClockSource* system();
+	virtual ~ClockSource() {}
+	
+	virtual steady_clock::time_point now() const = 0;
+	virtual void sleep_until(steady_clock::time_point t) = 0;
+	
+	// releases the lock and blocks until the condition variable is notified through this clock,
+	// or until t (steady_clock::time_point::max() for no timeout). spurious wake-ups are possible.
+	virtual void wait_until(condition_variable& cv, unique_lock<mutex>& lock,
+	                        steady_clock::time_point t) = 0;
+	virtual void notify_one(condition_variable& cv) = 0;
+	virtual void notify_all(condition_variable& cv) = 0;
+	
+	// a thread which waits through this clock is registered before it is created,
+	// and unregistered by itself before it returns.
+	virtual void add_thread() {}
+	virtual void remove_thread() {}
+	
+	void sleep_for(steady_clock::duration d);
+	unsigned long int ms_since(steady_clock::time_point t) const;
+	template <typename Pred> void wait(condition_variable& cv, unique_lock<mutex>& lock, Pred pred);
+	void join(thread& th); //the caller is not counted as running while it is blocked
+};
+
+class SystemClock: public ClockSource
+{
+public:
+	steady_clock::time_point now() const override;
+	void sleep_until(steady_clock::time_point t) override;
+	void wait_until(condition_variable& cv, unique_lock<mutex>& lock,
+	                steady_clock::time_point t) override;
+	void notify_one(condition_variable& cv) override;
+	void notify_all(condition_variable& cv) override;
+};
+
+// discrete-event clock: the time stands still while any registered thread is running, and jumps
+// to the earliest deadline when all of them are waiting. it starts from a day after the epoch of
+// steady_clock, so default-constructed time points are long ago as they are in real time.
+class VirtualClock: public ClockSource
+{
+	struct Waiter {
+		steady_clock::time_point t;
+		const condition_variable* cv; //NULL for sleeping threads
+		bool woken;
+	};
+	
+	mutable mutex mtx; condition_variable cv_clock;
+	steady_clock::time_point t_now;
+	unsigned int cnt_threads = 0;
+	vector<Waiter*> waiters;
+	
+	void block(Waiter* w, unique_lock<mutex>& lock_clock);
+	void advance();
+	void wake(const condition_variable* cv, bool all);
+
+public:
+	VirtualClock();
+	
+	steady_clock::time_point now() const override;
+	void sleep_until(steady_clock::time_point t) override;
+	void wait_until(condition_variable& cv, unique_lock<mutex>& lock,
+	                steady_clock::time_point t) override;
+	void notify_one(condition_variable& cv) override;
+	void notify_all(condition_variable& cv) override;
+	void add_thread() override;
+	void remove_thread() override;
+};
+
+inline void ClockSource::sleep_for(steady_clock::duration d)
+{
+	sleep_until(now() + d);
+}
+
+inline unsigned long int ClockSource::ms_since(steady_clock::time_point t) const
+{
+	return duration_cast<milliseconds>(now() - t).count();
+}
+
+template <typename Pred>
+inline void ClockSource::wait(condition_variable& cv, unique_lock<mutex>& lock, Pred pred)
+{
+	while (! pred())
+		wait_until(cv, lock, steady_clock::time_point::max());
+}
+
+inline void ClockSource::join(thread& th)
+{
+	remove_thread(); th.join(); add_thread();
+}
+
+inline steady_clock::time_point SystemClock::now() const
+{
+	return steady_clock::now();
+}
+
+inline void SystemClock::sleep_until(steady_clock::time_point t)
+{
+	this_thread::sleep_until(t);
+}
+
+inline void SystemClock::notify_one(condition_variable& cv)
+{
+	cv.notify_one();
+}
+
+inline void SystemClock::notify_all(condition_variable& cv)
+{
+	cv.notify_all();
+}
+
+#endif
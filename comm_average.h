@@ -0,0 +1,346 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef COMM_AVERAGE_H
+#define COMM_AVERAGE_H
+
+#include <cstdint>
+#include <cmath>
+
+#include "comm_protocol.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#include <immintrin.h>
+	#define COMM_AVERAGE_X86 //SSE2 or AVX2 is chosen at runtime, the build doesn't need -mavx2
+#elif defined(__ARM_NEON)
+	#include <arm_neon.h>
+	#define COMM_AVERAGE_NEON //given by the target of the build (always available on AArch64)
+#endif
+
+// stable averages of the ADC readings on the host side: extreme values are removed, then
+// readings around the reference average are averaged (see CommLayer::Oversampling_Radius).
+
+// sums of a chunk of interleaved ADC1/ADC2 readings, [0] is of ADC1 and [1] is of ADC2.
+// they are found in a single pass by pair_stats().
+struct PairStats
+{
+	uint32_t sum[2]; uint64_t sum_sq[2];
+	uint16_t min[2], max[2];
+	uint16_t bits[2]; //all values ORed, it exceeds ADC_Raw_Value_Max if any value is invalid
+	
+	bool is_valid(int ch) const {return bits[ch] <= ADC_Raw_Value_Max;}
+	float variance(int ch, uint32_t cnt) const; //of the raw values (LSB^2)
+};
+
+inline void pair_stats(const uint16_t* pairs, uint32_t cnt, PairStats* st);
+
+inline float PairStats::variance(int ch, uint32_t cnt) const
+{
+	if (cnt == 0) return 0;
+	double av = (double)sum[ch] / cnt, var = (double)sum_sq[ch] / cnt - av * av;
+	return (var > 0)? var : 0;
+}
+
+static inline void pair_stats_init(PairStats* st)
+{
+	for (int ch = 0; ch < 2; ch++) {
+		st->sum[ch] = 0; st->sum_sq[ch] = 0;
+		st->min[ch] = UINT16_MAX; st->max[ch] = 0; st->bits[ch] = 0;
+	}
+}
+
+// adds the readings to st. the sums of any 16-bit values are the same as the vector paths give
+static inline void pair_stats_add_scalar(const uint16_t* pairs, uint32_t cnt, PairStats* st)
+{
+	for (uint32_t i = 0; i < cnt; i++, pairs += 2) {
+		for (int ch = 0; ch < 2; ch++) {
+			uint16_t v = pairs[ch];
+			st->sum[ch] += v; st->sum_sq[ch] += (uint32_t)v * v;
+			if (v < st->min[ch]) st->min[ch] = v;
+			if (v > st->max[ch]) st->max[ch] = v;
+			st->bits[ch] |= v;
+		}
+	}
+}
+
+static inline void pair_stats_scalar(const uint16_t* pairs, uint32_t cnt, PairStats* st)
+{
+	pair_stats_init(st);
+	pair_stats_add_scalar(pairs, cnt, st);
+}
+
+#ifdef COMM_AVERAGE_X86
+// lanes of the vector registers are reduced into st. ADC1 readings are in the even 16-bit lanes.
+static inline void pair_stats_reduce(const uint32_t* sum, const uint64_t* sum_sq, unsigned int cnt_lanes_32,
+                                     const uint16_t* min, const uint16_t* max, const uint16_t* bits,
+                                     PairStats* st)
+{
+	for (unsigned int i = 0; i < cnt_lanes_32; i++) {
+		st->sum[0] += sum[2 * i]; st->sum[1] += sum[2 * i + 1];
+		st->sum_sq[0] += sum_sq[2 * i]; st->sum_sq[1] += sum_sq[2 * i + 1];
+	}
+	for (unsigned int i = 0; i < 2 * cnt_lanes_32; i++) {
+		int ch = i % 2;
+		if (min[i] < st->min[ch]) st->min[ch] = min[i];
+		if (max[i] > st->max[ch]) st->max[ch] = max[i];
+		st->bits[ch] |= bits[i];
+	}
+}
+
+// 4 pairs in each step. each 32-bit lane holds a pair: ADC1 values are masked and ADC2 values
+// are shifted into 32-bit lanes for the sums, then squared into 64-bit lanes by _mm_mul_epu32.
+// SSE2 has only signed 16-bit min/max, so the values are biased by 0x8000.
+__attribute__((target("sse2")))
+static inline void pair_stats_sse2(const uint16_t* pairs, uint32_t cnt, PairStats* st)
+{
+	const __m128i mask_lo = _mm_set1_epi32(0xffff), bias = _mm_set1_epi16((short)0x8000);
+	__m128i sum1 = _mm_setzero_si128(), sum2 = sum1, //32-bit lanes
+	        sq1_even = sum1, sq1_odd = sum1, sq2_even = sum1, sq2_odd = sum1, //64-bit lanes
+	        vmin = _mm_set1_epi16(0x7fff), vmax = _mm_set1_epi16((short)0x8000), vbits = sum1;
+	
+	uint32_t i = 0;
+	for (; i + 4 <= cnt; i += 4, pairs += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)pairs);
+		__m128i v1 = _mm_and_si128(v, mask_lo), v2 = _mm_srli_epi32(v, 16);
+		sum1 = _mm_add_epi32(sum1, v1); sum2 = _mm_add_epi32(sum2, v2);
+		sq1_even = _mm_add_epi64(sq1_even, _mm_mul_epu32(v1, v1));
+		sq2_even = _mm_add_epi64(sq2_even, _mm_mul_epu32(v2, v2));
+		v1 = _mm_srli_epi64(v1, 32); v2 = _mm_srli_epi64(v2, 32);
+		sq1_odd = _mm_add_epi64(sq1_odd, _mm_mul_epu32(v1, v1));
+		sq2_odd = _mm_add_epi64(sq2_odd, _mm_mul_epu32(v2, v2));
+		
+		__m128i vb = _mm_xor_si128(v, bias);
+		vmin = _mm_min_epi16(vmin, vb); vmax = _mm_max_epi16(vmax, vb);
+		vbits = _mm_or_si128(vbits, v);
+	}
+	vmin = _mm_xor_si128(vmin, bias); vmax = _mm_xor_si128(vmax, bias);
+	
+	// the sums of both channels are interleaved again for pair_stats_reduce()
+	uint32_t s[8]; uint64_t q[8]; uint16_t mn[8], mx[8], b[8];
+	_mm_storeu_si128((__m128i*)s, _mm_unpacklo_epi32(sum1, sum2));
+	_mm_storeu_si128((__m128i*)(s + 4), _mm_unpackhi_epi32(sum1, sum2));
+	_mm_storeu_si128((__m128i*)q, _mm_unpacklo_epi64(sq1_even, sq2_even));
+	_mm_storeu_si128((__m128i*)(q + 2), _mm_unpackhi_epi64(sq1_even, sq2_even));
+	_mm_storeu_si128((__m128i*)(q + 4), _mm_unpacklo_epi64(sq1_odd, sq2_odd));
+	_mm_storeu_si128((__m128i*)(q + 6), _mm_unpackhi_epi64(sq1_odd, sq2_odd));
+	_mm_storeu_si128((__m128i*)mn, vmin); _mm_storeu_si128((__m128i*)mx, vmax);
+	_mm_storeu_si128((__m128i*)b, vbits);
+	
+	pair_stats_init(st);
+	pair_stats_reduce(s, q, 4, mn, mx, b, st);
+	pair_stats_add_scalar(pairs, cnt - i, st);
+}
+
+// the same as pair_stats_sse2(), 8 pairs in each step
+__attribute__((target("avx2")))
+static inline void pair_stats_avx2(const uint16_t* pairs, uint32_t cnt, PairStats* st)
+{
+	const __m256i mask_lo = _mm256_set1_epi32(0xffff);
+	__m256i sum1 = _mm256_setzero_si256(), sum2 = sum1,
+	        sq1_even = sum1, sq1_odd = sum1, sq2_even = sum1, sq2_odd = sum1,
+	        vmin = _mm256_set1_epi16((short)0xffff), vmax = sum1, vbits = sum1;
+	
+	uint32_t i = 0;
+	for (; i + 8 <= cnt; i += 8, pairs += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)pairs);
+		__m256i v1 = _mm256_and_si256(v, mask_lo), v2 = _mm256_srli_epi32(v, 16);
+		sum1 = _mm256_add_epi32(sum1, v1); sum2 = _mm256_add_epi32(sum2, v2);
+		sq1_even = _mm256_add_epi64(sq1_even, _mm256_mul_epu32(v1, v1));
+		sq2_even = _mm256_add_epi64(sq2_even, _mm256_mul_epu32(v2, v2));
+		v1 = _mm256_srli_epi64(v1, 32); v2 = _mm256_srli_epi64(v2, 32);
+		sq1_odd = _mm256_add_epi64(sq1_odd, _mm256_mul_epu32(v1, v1));
+		sq2_odd = _mm256_add_epi64(sq2_odd, _mm256_mul_epu32(v2, v2));
+		
+		vmin = _mm256_min_epu16(vmin, v); vmax = _mm256_max_epu16(vmax, v);
+		vbits = _mm256_or_si256(vbits, v);
+	}
+	
+	uint32_t s[16]; uint64_t q[16]; uint16_t mn[16], mx[16], b[16];
+	_mm256_storeu_si256((__m256i*)s, _mm256_unpacklo_epi32(sum1, sum2));
+	_mm256_storeu_si256((__m256i*)(s + 8), _mm256_unpackhi_epi32(sum1, sum2));
+	_mm256_storeu_si256((__m256i*)q, _mm256_unpacklo_epi64(sq1_even, sq2_even));
+	_mm256_storeu_si256((__m256i*)(q + 4), _mm256_unpackhi_epi64(sq1_even, sq2_even));
+	_mm256_storeu_si256((__m256i*)(q + 8), _mm256_unpacklo_epi64(sq1_odd, sq2_odd));
+	_mm256_storeu_si256((__m256i*)(q + 12), _mm256_unpackhi_epi64(sq1_odd, sq2_odd));
+	_mm256_storeu_si256((__m256i*)mn, vmin); _mm256_storeu_si256((__m256i*)mx, vmax);
+	_mm256_storeu_si256((__m256i*)b, vbits);
+	
+	pair_stats_init(st);
+	pair_stats_reduce(s, q, 8, mn, mx, b, st);
+	pair_stats_add_scalar(pairs, cnt - i, st);
+}
+#endif
+
+#ifdef COMM_AVERAGE_NEON
+// 8 pairs in each step, vld2q_u16() separates the channels
+static inline void pair_stats_neon(const uint16_t* pairs, uint32_t cnt, PairStats* st)
+{
+	uint32x4_t sum[2] = {vdupq_n_u32(0), vdupq_n_u32(0)};
+	uint64x2_t sum_sq[2] = {vdupq_n_u64(0), vdupq_n_u64(0)};
+	uint16x8_t vmin[2] = {vdupq_n_u16(UINT16_MAX), vdupq_n_u16(UINT16_MAX)},
+	           vmax[2] = {vdupq_n_u16(0), vdupq_n_u16(0)}, vbits[2] = {vdupq_n_u16(0), vdupq_n_u16(0)};
+	
+	uint32_t i = 0;
+	for (; i + 8 <= cnt; i += 8, pairs += 16) {
+		uint16x8x2_t v = vld2q_u16(pairs);
+		for (int ch = 0; ch < 2; ch++) {
+			uint16x8_t x = v.val[ch];
+			sum[ch] = vpadalq_u16(sum[ch], x);
+			sum_sq[ch] = vpadalq_u32(sum_sq[ch], vmull_u16(vget_low_u16(x), vget_low_u16(x)));
+			sum_sq[ch] = vpadalq_u32(sum_sq[ch], vmull_u16(vget_high_u16(x), vget_high_u16(x)));
+			vmin[ch] = vminq_u16(vmin[ch], x); vmax[ch] = vmaxq_u16(vmax[ch], x);
+			vbits[ch] = vorrq_u16(vbits[ch], x);
+		}
+	}
+	
+	pair_stats_init(st);
+	for (int ch = 0; ch < 2; ch++) {
+		uint32_t s[4]; uint64_t q[2]; uint16_t mn[8], mx[8], b[8];
+		vst1q_u32(s, sum[ch]); vst1q_u64(q, sum_sq[ch]);
+		vst1q_u16(mn, vmin[ch]); vst1q_u16(mx, vmax[ch]); vst1q_u16(b, vbits[ch]);
+		st->sum[ch] = s[0] + s[1] + s[2] + s[3]; st->sum_sq[ch] = q[0] + q[1];
+		for (int k = 0; k < 8; k++) {
+			if (mn[k] < st->min[ch]) st->min[ch] = mn[k];
+			if (mx[k] > st->max[ch]) st->max[ch] = mx[k];
+			st->bits[ch] |= b[k];
+		}
+	}
+	pair_stats_add_scalar(pairs, cnt - i, st);
+}
+#endif
+
+inline void pair_stats(const uint16_t* pairs, uint32_t cnt, PairStats* st)
+{
+	#if defined(COMM_AVERAGE_X86)
+		static const bool avx2 = __builtin_cpu_supports("avx2"),
+		                  sse2 = __builtin_cpu_supports("sse2");
+		if (avx2) {
+			pair_stats_avx2(pairs, cnt, st); return;
+		}
+		if (sse2) {
+			pair_stats_sse2(pairs, cnt, st); return;
+		}
+	#elif defined(COMM_AVERAGE_NEON)
+		pair_stats_neon(pairs, cnt, st); return;
+	#endif
+	pair_stats_scalar(pairs, cnt, st);
+}
+
+// counts of the 12-bit codes, with a bit for each non-empty bin, so the empty ones are skipped.
+// it is cleared by the same values which are added.
+struct CodeHistogram
+{
+	uint16_t counts[ADC_Raw_Value_Max + 1];
+	uint64_t bins_used[(ADC_Raw_Value_Max + 1) / 64];
+	
+	void add(uint16_t v) {counts[v]++; bins_used[v / 64] |= 1ULL << (v % 64);}
+	void clear(uint16_t v) {counts[v] = 0; bins_used[v / 64] = 0;}
+	uint16_t next(uint16_t v) const; //the first non-empty bin from v upwards, there must be one
+	uint16_t prev(uint16_t v) const; //the first non-empty bin from v downwards, there must be one
+};
+
+inline uint16_t CodeHistogram::next(uint16_t v) const
+{
+	unsigned int w = v / 64; uint64_t bits = bins_used[w] & (~0ULL << (v % 64));
+	while (! bits) bits = bins_used[++w];
+	return w * 64 + __builtin_ctzll(bits);
+}
+
+inline uint16_t CodeHistogram::prev(uint16_t v) const
+{
+	unsigned int w = v / 64; uint64_t bits = bins_used[w] & (~0ULL >> (63 - v % 64));
+	while (! bits) bits = bins_used[--w];
+	return w * 64 + 63 - __builtin_clzll(bits);
+}
+
+// the reference average is the mean of the remaining data after cnt/8 lowest and cnt/8 highest
+// values are removed; it is found by a counting histogram of the 12-bit codes instead of sorting.
+inline float get_stable_average(const CodeHistogram& hist, unsigned int cnt, uint32_t sum,
+                                uint16_t v_min, uint16_t v_max, float diff_max)
+{
+	// get the reference average. (without influence of extreme values)
+	uint16_t border = cnt / 8; //2*border items will be removed
+	uint16_t cnt_rem = cnt - 2*border;
+	uint16_t curr_min = v_min, curr_max = v_max;
+	
+	unsigned int k = 0;
+	for (uint16_t v = v_min; ; v = hist.next(v + 1)) {
+		uint16_t c = hist.counts[v];
+		if (k + c > border) {
+			sum -= (border - k) * v; curr_min = v; break;
+		}
+		sum -= c * v; k += c;
+	}
+	k = 0;
+	for (uint16_t v = v_max; ; v = hist.prev(v - 1)) {
+		uint16_t c = hist.counts[v];
+		if (k + c > border) {
+			sum -= (border - k) * v; curr_max = v; break;
+		}
+		sum -= c * v; k += c;
+	}
+	
+	if ((curr_max - curr_min) / 2 > 8 * diff_max) return 0; //invalid data
+	float av1 = (float)sum / cnt_rem;
+	
+	// set the over sampling boundary depending on the reference average calculated above.
+	// only the bins around av1 are visited, each is checked as the raw values were.
+	int w_lo = floor(av1 - diff_max) - 1, w_hi = ceil(av1 + diff_max) + 1;
+	if (w_lo < v_min) w_lo = v_min;
+	if (w_hi > v_max) w_hi = v_max;
+	
+	sum = 0; cnt_rem = 0;
+	for (int w = w_lo; w <= w_hi; w++) {
+		uint16_t v = w, c = hist.counts[v];
+		if (c && fabs(v - av1) <= diff_max) {
+			sum += c * v;
+			cnt_rem += c;
+		}
+	}
+	if (cnt_rem == 0) return 0;
+	return (float)sum / cnt_rem;
+}
+
+// the histograms of both channels are filled in a single pass after pair_stats(), they are
+// kept per thread and cleared after each call, so no allocation is needed. a channel with a value
+// beyond ADC_Raw_Value_Max is treated as invalid (0). the in-window counts are taken from the
+// histograms, as the window depends on the reference average.
+inline void get_stable_averages(const uint16_t* raw_pairs, unsigned int cnt, const PairStats& st,
+                                float diff_max, float* av_1, float* av_2)
+{
+	*av_1 = *av_2 = 0;
+	if (raw_pairs == NULL || cnt == 0) return;
+	
+	static thread_local CodeHistogram hist1 = {}, hist2 = {};
+	
+	bool valid1 = st.is_valid(0), valid2 = st.is_valid(1);
+	const uint16_t* p = raw_pairs;
+	if (valid1 && valid2) {
+		for (unsigned int i = 0; i < cnt; i++, p += 2) {
+			hist1.add(p[0]); hist2.add(p[1]);
+		}
+	} else {
+		for (unsigned int i = 0; i < cnt; i++, p += 2) {
+			if (valid1) hist1.add(p[0]);
+			if (valid2) hist2.add(p[1]);
+		}
+	}
+	
+	if (valid1) *av_1 = get_stable_average(hist1, cnt, st.sum[0], st.min[0], st.max[0], diff_max);
+	if (valid2) *av_2 = get_stable_average(hist2, cnt, st.sum[1], st.min[1], st.max[1], diff_max);
+	
+	p = raw_pairs;
+	for (unsigned int i = 0; i < cnt; i++, p += 2) {
+		if (valid1) hist1.clear(p[0]);
+		if (valid2) hist2.clear(p[1]);
+	}
+}
+
+inline void get_stable_averages(const uint16_t* raw_pairs, unsigned int cnt, float diff_max,
+                                float* av_1, float* av_2)
+{
+	PairStats st; pair_stats(raw_pairs, cnt, &st);
+	get_stable_averages(raw_pairs, cnt, st, diff_max, av_1, av_2);
+}
+
+#endif
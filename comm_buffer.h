@@ -0,0 +1,188 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef COMM_BUFFER_H
+#define COMM_BUFFER_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <mutex>
+
+// receive buffer for the byte stream from the MCU. unread bytes are always contiguous,
+// so a frame can be parsed in place; data() is valid until the next call of space().
+class RecvBuffer
+{
+	uint8_t* buf = NULL;
+	uint32_t cap = 0, pos_begin = 0, pos_end = 0;
+
+public:
+	RecvBuffer() {}
+	RecvBuffer(const RecvBuffer&) = delete;
+	RecvBuffer& operator=(const RecvBuffer&) = delete;
+	~RecvBuffer();
+	
+	uint32_t capacity() const;
+	uint32_t size() const; //count of unread bytes
+	const uint8_t* data() const;
+	
+	void reserve(uint32_t new_cap); //unread bytes are kept
+	void clear();
+	
+	uint8_t* space(uint32_t* sz_space); //writable area after unread bytes
+	void commit(uint32_t cnt); //cnt bytes are written into the area returned by space()
+	void consume(uint32_t cnt);
+	
+	// returns offset of the first occurrence of the pattern in unread bytes, or size()
+	// if it is not found. if the pattern might be cut at the end, its offset is returned.
+	uint32_t find(const uint8_t* pattern, uint32_t sz_pattern) const;
+};
+
+inline RecvBuffer::~RecvBuffer()
+{
+	delete[] buf;
+}
+
+inline uint32_t RecvBuffer::capacity() const
+{
+	return cap;
+}
+
+inline uint32_t RecvBuffer::size() const
+{
+	return pos_end - pos_begin;
+}
+
+inline const uint8_t* RecvBuffer::data() const
+{
+	return buf + pos_begin;
+}
+
+inline void RecvBuffer::reserve(uint32_t new_cap)
+{
+	if (new_cap <= cap) return;
+	
+	uint8_t* new_buf = new uint8_t[new_cap];
+	if (buf) {
+		memcpy(new_buf, buf + pos_begin, size());
+		delete[] buf;
+	}
+	pos_end -= pos_begin; pos_begin = 0;
+	buf = new_buf; cap = new_cap;
+}
+
+inline void RecvBuffer::clear()
+{
+	pos_begin = pos_end = 0;
+}
+
+inline uint8_t* RecvBuffer::space(uint32_t* sz_space)
+{
+	if (pos_begin > 0) { //move unread bytes to the front, usually there are only a few
+		memmove(buf, buf + pos_begin, size());
+		pos_end -= pos_begin; pos_begin = 0;
+	}
+	*sz_space = cap - pos_end;
+	return buf + pos_end;
+}
+
+inline void RecvBuffer::commit(uint32_t cnt)
+{
+	if (cnt > cap - pos_end) cnt = cap - pos_end;
+	pos_end += cnt;
+}
+
+inline void RecvBuffer::consume(uint32_t cnt)
+{
+	if (cnt >= size()) {
+		clear(); return;
+	}
+	pos_begin += cnt;
+}
+
+inline uint32_t RecvBuffer::find(const uint8_t* pattern, uint32_t sz_pattern) const
+{
+	if (sz_pattern == 0) return 0;
+	
+	const uint8_t* p = data(), * p_end = data() + size();
+	while (p < p_end) {
+		p = (const uint8_t*) memchr(p, pattern[0], p_end - p);
+		if (p == NULL) break;
+		uint32_t l_cmp = p_end - p;
+		if (l_cmp > sz_pattern) l_cmp = sz_pattern;
+		if (memcmp(p, pattern, l_cmp) == 0)
+			return p - data();
+		p++;
+	}
+	return size();
+}
+
+// free list of blocks of the same size. the blocks are kept until the pool is destroyed, so nothing
+// is allocated once the count of blocks in use has reached its maximum. a request of another size
+// is passed to operator new.
+class BlockPool
+{
+	std::mutex mtx;
+	std::vector<void*> blocks_all, blocks_free;
+	size_t sz_block = 0;
+
+public:
+	BlockPool() {}
+	BlockPool(const BlockPool&) = delete;
+	BlockPool& operator=(const BlockPool&) = delete;
+	~BlockPool();
+	
+	void* take(size_t sz);
+	void give(void* p, size_t sz);
+};
+
+// for allocate_shared(), the control block and the object are taken from the pool as one block.
+template <typename T>
+struct BlockPoolAllocator
+{
+	using value_type = T;
+	BlockPool* pool;
+	
+	BlockPoolAllocator(BlockPool* pool): pool(pool) {}
+	template <typename U> BlockPoolAllocator(const BlockPoolAllocator<U>& a): pool(a.pool) {}
+	
+	T* allocate(size_t n) {return static_cast<T*>(pool->take(n * sizeof(T)));}
+	void deallocate(T* p, size_t n) {pool->give(p, n * sizeof(T));}
+	
+	template <typename U> bool operator==(const BlockPoolAllocator<U>& a) const {return pool == a.pool;}
+	template <typename U> bool operator!=(const BlockPoolAllocator<U>& a) const {return pool != a.pool;}
+};
+
+inline BlockPool::~BlockPool()
+{
+	for (void* p : blocks_all)
+		::operator delete(p);
+}
+
+inline void* BlockPool::take(size_t sz)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (sz_block == 0) sz_block = sz;
+	if (sz != sz_block) return ::operator new(sz);
+	
+	if (! blocks_free.empty()) {
+		void* p = blocks_free.back(); blocks_free.pop_back();
+		return p;
+	}
+	void* p = ::operator new(sz);
+	blocks_all.push_back(p); blocks_free.reserve(blocks_all.size()); //give() doesn't allocate
+	return p;
+}
+
+inline void BlockPool::give(void* p, size_t sz)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (sz != sz_block) {
+		::operator delete(p); return;
+	}
+	blocks_free.push_back(p);
+}
+
+#endif
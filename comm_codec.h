@@ -0,0 +1,98 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef COMM_CODEC_H
+#define COMM_CODEC_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "comm_protocol.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#include <immintrin.h>
+	#define COMM_CODEC_SSSE3 //chosen at runtime, the build doesn't need -mssse3
+#endif
+
+// decoders of the packed data formats (see comm_protocol.h) on the host side. readings are written
+// as interleaved ADC1/ADC2 values, the same as Data_Format_Raw on a little-endian machine.
+
+// returns the count of bytes taken, or 0 if the block is broken. the block must be complete.
+inline uint32_t data_block_decode(uint8_t data_format, const uint8_t* src, uint32_t cnt, uint16_t* pairs);
+
+inline void data_unpack_12b(const uint8_t* src, uint32_t cnt, uint16_t* pairs);
+inline uint32_t data_delta_decode(const uint8_t* src, uint32_t cnt, uint16_t* pairs);
+
+static inline void data_unpack_12b_scalar(const uint8_t* src, uint32_t cnt, uint16_t* pairs)
+{
+	for (uint32_t i = 0; i < cnt; i++, src += 3, pairs += 2) {
+		pairs[0] = src[0] | ((src[1] & 0x0f) << 8);
+		pairs[1] = (src[1] >> 4) | (src[2] << 4);
+	}
+}
+
+#ifdef COMM_CODEC_SSSE3
+// 4 readings (12 bytes) in each step: the bytes of each 12-bit value are shuffled into its 16-bit lane,
+// then ADC1 values (even lanes) are masked and ADC2 values (odd lanes) are shifted.
+__attribute__((target("ssse3")))
+static inline void data_unpack_12b_ssse3(const uint8_t* src, uint32_t cnt, uint16_t* pairs)
+{
+	const __m128i shuf = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+	const __m128i mask_even = _mm_set1_epi32(0x00000fff);
+	const __m128i mask_odd = _mm_set1_epi32((int)0xffff0000);
+	
+	uint32_t i = 0;
+	for (; i + 6 <= cnt; i += 4, src += 12, pairs += 8) { //16 bytes are loaded
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), shuf);
+		__m128i adc1 = _mm_and_si128(v, mask_even),
+		        adc2 = _mm_and_si128(_mm_srli_epi16(v, 4), mask_odd);
+		_mm_storeu_si128((__m128i*)pairs, _mm_or_si128(adc1, adc2));
+	}
+	data_unpack_12b_scalar(src, cnt - i, pairs);
+}
+#endif
+
+inline void data_unpack_12b(const uint8_t* src, uint32_t cnt, uint16_t* pairs)
+{
+	#ifdef COMM_CODEC_SSSE3
+		static const bool ssse3 = __builtin_cpu_supports("ssse3");
+		if (ssse3) {
+			data_unpack_12b_ssse3(src, cnt, pairs); return;
+		}
+	#endif
+	data_unpack_12b_scalar(src, cnt, pairs);
+}
+
+// each difference depends on the previous reading, so it's decoded in order
+inline uint32_t data_delta_decode(const uint8_t* src, uint32_t cnt, uint16_t* pairs)
+{
+	uint8_t width = src[0];
+	if (width > 12) return 0;
+	data_unpack_12b_scalar(src + 1, 1, pairs);
+	
+	const uint8_t* p = src + 4; uint32_t acc = 0; uint8_t cnt_bits = 0;
+	const uint32_t mask = (1u << width) - 1;
+	for (uint32_t i = 2; i < 2 * cnt; i++) {
+		while (cnt_bits < width) {
+			acc |= (uint32_t)*(p++) << cnt_bits; cnt_bits += 8;
+		}
+		uint32_t zz = acc & mask; acc >>= width; cnt_bits -= width;
+		int32_t d = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+		pairs[i] = (pairs[i - 2] + d) & 0x0fff;
+	}
+	return data_block_size(Data_Format_Delta, cnt, width);
+}
+
+inline uint32_t data_block_decode(uint8_t data_format, const uint8_t* src, uint32_t cnt, uint16_t* pairs)
+{
+	switch (data_format) {
+		case Data_Format_Packed:
+			data_unpack_12b(src, cnt, pairs); return 3 * cnt;
+		case Data_Format_Delta:
+			return data_delta_decode(src, cnt, pairs);
+		default:
+			memcpy(pairs, src, 2 * 2 * cnt); return 2 * 2 * cnt;
+	}
+}
+
+#endif
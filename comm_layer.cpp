@@ -2,10 +2,18 @@
 // If you have found bugs in this program, please pull an issue, or contact me.
 
 #include "comm_layer.h"
+#include "comm_codec.h"
 
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
 #include <string>
+#include <fstream>
+#include <algorithm>
+
+#ifdef __linux__
+	#include <dirent.h>
+#endif
 
 #ifdef dbg_print
 	#undef dbg_print
@@ -30,40 +38,54 @@
 using namespace std::chrono;
 using namespace std::this_thread;
 
-CommLayer::CommLayer(): buf_vdda(64) {}
+CommLayer::CommLayer(ClockSource* clock, CommTransport* transport):
+	clk(clock), transport(transport)
+{
+	if (! clk) clk = ClockSource::system();
+	if (! this->transport) this->transport = CommTransport::create();
+	
+	cmds_queued.reserve(Cmds_Queued_Reserve); cmds_failed.reserve(Cmds_Queued_Reserve);
+	cmds_in_flight.reserve(Cmds_In_Flight_Max);
+	
+	// fills the pool, the futures are released at once
+	shared_ptr<CmdFuture::State> states[Cmds_Queued_Reserve + Cmds_In_Flight_Max];
+	for (auto& st : states)
+		st = allocate_shared<CmdFuture::State>(BlockPoolAllocator<CmdFuture::State>(&pool_cmd_states));
+}
 
 bool CommLayer::connect(DataCallbackPtr cb_ptr)
 {
-	string str_port_name; int open_result;
+	// the ports are probed concurrently, then the first responsive one in order is opened
+	vector<PortInfo> ports;
+	vector<char> responsive;
+	if (transport->is_replay()) { //there is no port to be probed
+		ports.resize(1); responsive.resize(1, true);
+	} else {
+		ports = list_ports();
+		vector<string> names;
+		for (const PortInfo& port : ports) names.push_back(port.name);
+		responsive = probe_ports(names);
+	}
 	
-	// scan in all serial ports
-	for (int i = 1; i <= 256; i++) {
-		#ifdef _WIN32
-			str_port_name = "\\\\.\\COM" + to_string(i);
-		#else
-			str_port_name = "/dev/ttyACM" + to_string(i - 1);
-		#endif
-		int open_result = serial.OpenDevice(str_port_name.c_str(), 9600);
-		if (open_result != 1) { //error
-			if (open_result != -1 && open_result != -2)
-				serial.CloseDevice();
-			continue;
-		}
-		
-		if (! apply_cmd(Cmd_ID_Check, &hard_param.resp)
-		||  ! hard_param.dac_support //TODO: support MCUs without DAC
-		||  ! adc_config()) {
-			serial.CloseDevice(); continue;
-		}
-		
+	for (unsigned int i = 0; i < ports.size(); i++) {
+		if (! responsive[i] || ! open_port(ports[i].name)) continue;
+		last_port_name = ports[i].name;
+		last_serial_number = ports[i].serial_number;
 		flag_connected = true; break;
 	}
 	
 	if (! flag_connected) return false;
-	
-	thread_comm = new thread(&CommLayer::comm_loop, this);
-	thread_proc = new thread(&CommLayer::process_loop, this);
-	callback_ptr = cb_ptr;
+	start_threads(cb_ptr);
+	return true;
+}
+
+bool CommLayer::connect(DataCallbackPtr cb_ptr, const string& port_name)
+{
+	if (! open_port(port_name)) return false;
+	last_port_name = port_name;
+	last_serial_number = port_info(port_name).serial_number;
+	flag_connected = true;
+	start_threads(cb_ptr);
 	return true;
 }
 
@@ -71,69 +93,323 @@ void CommLayer::disconnect()
 {
 	if (! flag_connected) return;
 	
-	flag_close = true;
-	thread_comm->join(); thread_proc->join();
+	{
+		lock_guard<mutex> lock(mtx_bulks);
+		flag_close = true;
+	}
+	clk->notify_all(cv_bulks);
+	clk->join(*thread_comm); clk->join(*thread_proc);
 	delete thread_comm; delete thread_proc;
 	flag_close = false;
-	serial.CloseDevice();
+	transport->close();
 	flag_connected = false;
-	
-	delete[] adc_raw_data;
-	delete[] adc1_raw_data; delete[] adc2_raw_data;
-	delete[] adc1_values; delete[] adc2_values;
+	rec_buf.clear();
 }
 
-bool CommLayer::shake()
+CmdFuture CommLayer::shake(CmdCallbackPtr cb_ptr)
 {
-	if (! flag_connected) return false;
-	
-	flag_shake = true;
-	unsigned int cnt_ms = 0;
-	while (flag_shake && cnt_ms < 2*Timeout_Data_Max) {
-		if (!flag_connected || flag_close) return false;
-		this_thread::sleep_for(milliseconds(30)); cnt_ms++;
+	return submit_cmd(comm_cmd(Cmd_ID_Shake), cb_ptr);
+}
+
+static inline bool is_output_cmd(uint8_t cmd_id)
+{
+	return cmd_id == Cmd_ID_PWM_DAC || cmd_id == Cmd_ID_Disable_Output;
+}
+
+CmdFuture CommLayer::submit_cmd(const CommCmd& cmd, CmdCallbackPtr cb_ptr)
+{
+	CmdFuture fut; fut.comm = this;
+	fut.st = allocate_shared<CmdFuture::State>(BlockPoolAllocator<CmdFuture::State>(&pool_cmd_states));
+	
+	CmdEntry entry; uint8_t length = cmd_length(cmd.cmd_id);
+	if (length) { //the union holds any command
+		memcpy(&entry.cmd, &cmd, length);
+		entry.st = fut.st; entry.cb_ptr = cb_ptr;
+		unique_lock<mutex> lock(mtx_cmds);
+		if (flag_cmds_open) {
+			// only the latest output setting is kept in the queue
+			bool output = is_output_cmd(cmd.cmd_id);
+			auto it = find_if(cmds_queued.begin(), cmds_queued.end(),
+			                  [output](const CmdEntry& e) {return output && is_output_cmd(e.cmd.cmd_id);});
+			if (it == cmds_queued.end()) {
+				cmds_queued.push_back(entry); return fut;
+			}
+			swap(*it, entry); lock.unlock();
+			finish_cmd(entry, false); //replaced
+			return fut;
+		}
 	}
 	
-	return flag_shake_success;
+	cb_ptr.call(cmd.cmd_id, false); fut.st->done = true;
+	return fut;
 }
 
 bool CommLayer::dac_output(float val)
 {
 	if (!flag_connected || val < 0 || val > vdda) return false;
+	if (flag_trip && val > 0) return false;
 	vdac = val; dac_new_val = from_voltage(val);
 	return flag_dac_output = true;
 }
 
 /*------------------------------ private functions ------------------------------*/
 
+#ifdef __linux__
+static string read_sysfs_attr(const string& path)
+{
+	string str;
+	ifstream ifs(path);
+	if (ifs) getline(ifs, str);
+	return str;
+}
+
+static unsigned int port_number(const string& port_name)
+{
+	size_t pos = port_name.find_last_not_of("0123456789");
+	return atoi(port_name.c_str() + pos + 1);
+}
+#endif
+
+CommLayer::PortInfo CommLayer::port_info(const string& port_name)
+{
+	PortInfo info; info.name = port_name;
+	
+#ifdef __linux__
+	// attributes of the USB device are in the parent of the interface directory
+	string name = port_name.substr(port_name.find_last_of('/') + 1);
+	string dir_usb = "/sys/class/tty/" + name + "/device/../";
+	info.serial_number = read_sysfs_attr(dir_usb + "serial");
+	info.id_matched =
+		strtoul(read_sysfs_attr(dir_usb + "idVendor").c_str(), NULL, 16) == USB_Vendor_ID
+	 && strtoul(read_sysfs_attr(dir_usb + "idProduct").c_str(), NULL, 16) == USB_Product_ID;
+#endif
+	
+	return info;
+}
+
+// lists the ports to be probed, the last connected device and devices with the
+// firmware's USB VID/PID come first. the nodes are listed from /dev, so links to
+// ptys (of usb_charge_emulator) are found as well; all possible port names are
+// listed if it is not available.
+vector<CommLayer::PortInfo> CommLayer::list_ports() const
+{
+	vector<PortInfo> ports; bool listed = false;
+	
+#ifdef __linux__
+	DIR* dir = opendir("/dev");
+	if (dir) {
+		listed = true;
+		while (dirent* ent = readdir(dir)) {
+			string name = ent->d_name;
+			if (name.compare(0, 6, "ttyACM") == 0)
+				ports.push_back(port_info("/dev/" + name));
+		}
+		closedir(dir);
+	}
+#endif
+	
+	if (! listed) {
+		for (int i = 1; i <= 256; i++) {
+			PortInfo info;
+			#ifdef _WIN32
+				info.name = "\\\\.\\COM" + to_string(i);
+			#else
+				info.name = "/dev/ttyACM" + to_string(i - 1);
+			#endif
+			ports.push_back(info);
+		}
+		return ports;
+	}
+	
+	auto rank = [this](const PortInfo& info) -> int {
+		if (info.name == last_port_name
+		&&  (last_serial_number.empty() || info.serial_number == last_serial_number))
+			return 0;
+		if (! last_serial_number.empty() && info.serial_number == last_serial_number)
+			return 1;
+		return info.id_matched? 2 : 3;
+	};
+	sort(ports.begin(), ports.end(), [&rank](const PortInfo& a, const PortInfo& b) {
+		int ra = rank(a), rb = rank(b);
+		if (ra != rb) return ra < rb;
+		#ifdef __linux__
+			return port_number(a.name) < port_number(b.name);
+		#else
+			return false;
+		#endif
+	});
+	return ports;
+}
+
+vector<char> CommLayer::probe_ports(const vector<string>& port_names, unsigned int cnt_threads_max)
+{
+	vector<char> responsive(port_names.size(), false);
+	if (cnt_threads_max < 1) cnt_threads_max = 1;
+	for (unsigned int i = 0; i < port_names.size(); i += cnt_threads_max) {
+		vector<thread> probes;
+		for (unsigned int j = i; j < port_names.size() && j < i + cnt_threads_max; j++)
+			probes.emplace_back([&port_names, &responsive, j] {responsive[j] = probe_port(port_names[j]);});
+		for (thread& th : probes) th.join();
+	}
+	return responsive;
+}
+
+// sends Cmd_ID_Check through a separate handle of the port, so it can be called in multiple threads.
+bool CommLayer::probe_port(const string& port_name)
+{
+	Serialib::Serial ser;
+	int open_result = ser.OpenDevice(port_name.c_str(), 9600);
+	if (open_result != 1) { //error
+		if (open_result != -1 && open_result != -2)
+			ser.CloseDevice();
+		return false;
+	}
+	
+	// the length of the response is given by ext_length, older firmwares send a shorter one
+	CommCmd cmd = comm_cmd(Cmd_ID_Check); Resp_Check resp;
+	const uint8_t sz_head = sizeof(CommResp);
+	bool suc = false;
+	for (int cnt_try = 2; cnt_try > 0 && !suc; cnt_try--) {
+		ser.FlushReceiver();
+		if (ser.WriteBytes((void*)&cmd, sizeof(cmd)) != 1) continue;
+		if (ser.ReadBytes((void*)&resp, sz_head, Timeout_Comm_Max, 1000) != sz_head) continue;
+		uint8_t l_resp = sz_head + resp.resp.ext_length;
+		suc = l_resp <= sizeof(resp)
+		   && ser.ReadBytes((uint8_t*)&resp + sz_head, l_resp - sz_head, Timeout_Comm_Max, 1000) == l_resp - sz_head
+		   && is_valid_resp((uint8_t*)&resp, l_resp);
+	}
+	
+	ser.CloseDevice();
+	return suc;
+}
+
+void CommLayer::start_threads(DataCallbackPtr cb_ptr)
+{
+	{
+		lock_guard<mutex> lock(mtx_cmds);
+		flag_cmds_open = true; t_keep_alive = steady_clock::time_point();
+	}
+	cmds_in_flight.clear(); cmd_seq = 0; bulk_data_amount_pending = 0;
+	clk->add_thread(); clk->add_thread();
+	thread_comm = new thread(&CommLayer::comm_loop, this);
+	thread_proc = new thread(&CommLayer::process_loop, this);
+	callback_ptr = cb_ptr;
+}
+
+bool CommLayer::open_port(const string& port_name)
+{
+	if (! transport->open(port_name)) return false;
+	rec_buf.clear();
+	memset(&hard_param, 0, sizeof(hard_param)); //for a shorter response
+	
+	if (! apply_cmd(Cmd_ID_Check, &hard_param.resp)
+	||  ! hard_param.dac_support //TODO: support MCUs without DAC
+	||  ! adc_config()) {
+		transport->close(); return false;
+	}
+	return true;
+}
+
 bool CommLayer::adc_config()
 {
 	adc_conf.cmd = comm_cmd(Cmd_ID_ADC_Start);
 	adc_conf.discontinous_mode = false;
 	adc_conf.adc_clock_cycles_opt =
 		choose_adc_clock_cycles_opt(&hard_param, Raw_Data_Interval);
-	bulk_interval_ms = hard_param.adc_bulk_data_amount
-					 * adc_raw_data_interval_ms(&hard_param, adc_conf.adc_clock_cycles_opt);
+	bulk_data_amount = hard_param.adc_bulk_data_amount; bulk_mode = Bulk_Default;
+	bulk_interval_ms = bulk_data_amount
+	                 * adc_raw_data_interval_ms(&hard_param, adc_conf.adc_clock_cycles_opt);
+	data_format = Data_Format_Raw;
+	if (bulk_mode_supported()) { //the amount and the format are kept by the device until it is reset
+		if ((hard_param.capabilities & Capability_Data_Packed)
+		&&  hard_param.adc_bulk_data_amount >= Data_Block_Amount) //the chunks are the blocks
+			data_format = data_format_pref;
+		Cmd_ADC_Config cmd = {comm_cmd(Cmd_ID_ADC_Config), bulk_data_amount,
+		                      adc_conf.adc_clock_cycles_opt, data_format};
+		if (! apply_cmd(cmd.cmd)) {
+			hard_param.capabilities &= ~Capability_ADC_Config; data_format = Data_Format_Raw;
+		}
+	}
 	if (! apply_cmd(adc_conf.cmd)) return false;
 	
 	if (! flag_override_vrefint)
 		vrefint = (float)hard_param.adc_vrefint / 1000.0;
-	buf_vdda.clear(true);
+	buf_vdda.clear();
 	
 	data_amount_per_av_first = Data_Amount_Per_Av_First;
-	if (data_amount_per_av_first > hard_param.adc_bulk_data_amount)
-		data_amount_per_av_first = hard_param.adc_bulk_data_amount;
-	data_amount_per_av_second = hard_param.adc_bulk_data_amount
-	                          / data_amount_per_av_first;
-	
-	adc_raw_data = new uint8_t[adc_bulk_data_size(&hard_param)];
-	adc1_raw_data = new uint16_t[hard_param.adc_bulk_data_amount];
-	adc2_raw_data = new uint16_t[hard_param.adc_bulk_data_amount];
-	adc1_values = new float[data_amount_per_av_second];
-	adc2_values = new float[data_amount_per_av_second];
+	if (data_amount_per_av_first > bulk_data_amount)
+		data_amount_per_av_first = bulk_data_amount;
+	data_amount_per_av_second = bulk_data_amount / data_amount_per_av_first;
+	chunk_interval_ms = bulk_interval_ms / bulk_data_amount * data_amount_per_av_first;
+	
+	// the buffers of the longest bulks are taken from one arena, which is only reallocated
+	// if a device with longer bulks is connected
+	// the long amount is rounded down to whole chunks, so it may be shorter than the default
+	uint16_t amount_max = bulk_amount(Bulk_Long);
+	if (amount_max < hard_param.adc_bulk_data_amount) amount_max = hard_param.adc_bulk_data_amount;
+	size_t cnt_values = (amount_max + data_amount_per_av_first - 1) / data_amount_per_av_first;
+	size_t sz_raw = 2 * 2 * amount_max, sz_values = sizeof(float) * cnt_values;
+	size_t sz_arena = 3 * (sz_raw + 4 * sz_values);
+	if (sz_arena > sz_bulk_arena) {
+		delete[] bulk_arena;
+		bulk_arena = new uint8_t[sz_arena]; sz_bulk_arena = sz_arena;
+	}
+	uint8_t* p = bulk_arena; //sz_raw is a multiple of 4, so the floats are aligned
+	for (int i = 0; i < 3; i++) {
+		bulks[i].adc_raw_data = p; p += sz_raw;
+		bulks[i].adc1_values = (float*) p; p += sz_values;
+		bulks[i].adc2_values = (float*) p; p += sz_values;
+		bulks[i].adc1_sd = (float*) p; p += sz_values;
+		bulks[i].adc2_sd = (float*) p; p += sz_values;
+	}
+	flag_data_ready = false; flag_trip = false;
+	stat = CommStatistics(); cnt_chunks_received = 0;
+	t_write_rate = clk->now(); cnt_writes_rate = 0;
+	rec_buf.reserve(2 * (Data_Header_Length + sizeof(uint16_t) + 2 * 2 * amount_max));
 	return true;
 }
 
+// the bulks are shortened or lengthened by Bulk_Size_Factor, in whole chunks
+uint16_t CommLayer::bulk_amount(CommBulkMode mode) const
+{
+	uint32_t amount = hard_param.adc_bulk_data_amount;
+	if (mode == Bulk_Default || ! bulk_mode_supported()) return amount;
+	
+	if (mode == Bulk_Short) amount /= Bulk_Size_Factor;
+	if (mode == Bulk_Long) amount *= Bulk_Size_Factor;
+	if (amount > hard_param.adc_bulk_data_amount_max) amount = hard_param.adc_bulk_data_amount_max;
+	amount -= amount % data_amount_per_av_first;
+	if (amount < data_amount_per_av_first) amount = data_amount_per_av_first;
+	return amount;
+}
+
+// in comm_loop(). the size is changed by bulk_config_callback(), only one change is in flight.
+void CommLayer::apply_bulk_mode(CommBulkMode mode)
+{
+	bulk_mode = mode;
+	uint16_t amount = bulk_amount(mode);
+	if (amount == bulk_data_amount) return;
+	
+	bulk_data_amount_pending = amount;
+	Cmd_ADC_Config cmd = {comm_cmd(Cmd_ID_ADC_Config), amount, adc_conf.adc_clock_cycles_opt, data_format};
+	submit_cmd(cmd.cmd, MemberFuncCmdCallbackPtr<CommLayer, &CommLayer::bulk_config_callback>(this));
+}
+
+// in comm_loop(), when the response is matched. bulks of the new size follow the response.
+void CommLayer::bulk_config_callback(uint8_t cmd_id, bool suc)
+{
+	uint16_t amount = bulk_data_amount_pending;
+	bulk_data_amount_pending = 0;
+	if (! suc) {
+		hard_param.capabilities &= ~Capability_ADC_Config; return; //don't try again
+	}
+	
+	bulk_data_amount = amount;
+	bulk_interval_ms = chunk_interval_ms / data_amount_per_av_first * amount;
+	data_amount_per_av_second = amount / data_amount_per_av_first;
+	dbg_print("bulk data amount: " + to_string(amount));
+}
+
 void CommLayer::comm_loop()
 {
 	// make sure there is no data to be received while sending shake command for the first time.
@@ -141,29 +417,26 @@ void CommLayer::comm_loop()
 	
 	while (true) {
 		if (flag_close) {
-			apply_cmd(Cmd_ID_ADC_Stop); return;
+			fail_cmds(); apply_cmd(Cmd_ID_ADC_Stop);
+			clk->remove_thread(); return;
 		}
 		
-		if (flag_dac_output) {
-			pwm_dac_conf.dac_val = dac_new_val;
-			if (dac_new_val > 0)
-				apply_cmd(pwm_dac_conf.cmd);
-			else
-				apply_cmd(Cmd_ID_Disable_Output);
-			flag_dac_output = false;
-		}
-		else if (flag_shake) {
-			flag_shake_success = apply_cmd(Cmd_ID_Shake);
-			flag_shake = false;
-		}
+		queue_dac_output();
+		if (bulk_mode_new != bulk_mode && bulk_data_amount_pending == 0)
+			apply_bulk_mode(bulk_mode_new);
 		
+		// queued commands are written while the data is being received, the ones above are
+		// written together at the beginning of the bulk
 		if (rec_data(bulk_interval_ms + Timeout_Data_Max)) {
-			flag_data_ready = true; //dbg_print("data received");
+			publish_data(); //dbg_print("data received");
 		} else {
 			dbg_print("failed to receive data");
 			if (apply_cmd(adc_conf.cmd)) continue;
-			thread th_disconnect(&CommLayer::disconnect, this);
-			th_disconnect.detach(); return;
+			fail_cmds();
+			clk->add_thread();
+			thread th_disconnect([this] {disconnect(); clk->remove_thread();});
+			th_disconnect.detach();
+			clk->remove_thread(); return;
 		}
 	}
 }
@@ -171,12 +444,16 @@ void CommLayer::comm_loop()
 void CommLayer::process_loop()
 {
 	while (true) {
-		this_thread::sleep_for(milliseconds(30));
-		
-		if (flag_close || !flag_connected) return;
-		if (! flag_data_ready) continue;
-		
-		flag_data_ready = false;
+		{
+			unique_lock<mutex> lock(mtx_bulks);
+			clk->wait(cv_bulks, lock, [this] {return flag_data_ready || flag_close || !flag_connected;});
+			if (flag_close || !flag_connected) {
+				clk->remove_thread(); return;
+			}
+			
+			swap(bulk_ready, bulk_proc); flag_data_ready = false;
+			stat.wake_latency.add(clk->now() - t_data_ready);
+		}
 		process_data();
 		
 		if (adc1_value == 0 && adc2_value == 0) {
@@ -191,182 +468,458 @@ void CommLayer::process_loop()
 
 bool CommLayer::apply_cmd(const CommCmd& cmd, CommResp* rec_data)
 {
-	uint8_t l_resp = resp_length(cmd.cmd_id);
-	uint8_t* tmp_data = new uint8_t[l_resp];
+	static const uint32_t protocol_header(Protocol_Header);
+	uint8_t l_resp = 0;
 	
-	bool suc = false;
+	bool suc = false; steady_clock::time_point t_sent = clk->now();
 	for (int cnt_try = 5; cnt_try > 0; cnt_try--) {
-		if (serial.WriteBytes((void*)&cmd, cmd_length(cmd.cmd_id)) != 1) {
-			this_thread::sleep_for(milliseconds(100)); continue;
+		if (! write(&cmd, cmd_length(cmd.cmd_id), 1)) {
+			clk->sleep_for(milliseconds(100)); continue;
 		}
 		
 		// dbg_print_bytes("S", &cmd, cmd_length(cmd.cmd_id));
 		if (cmd.cmd_id == Cmd_ID_PWM_DAC && ((Cmd_PWM_DAC*)&cmd)->no_resp)
 			return true;
 		
-		if (serial.ReadBytes((void*)tmp_data,  l_resp, Timeout_Comm_Max, 1000) < l_resp
-		||  !is_valid_resp((uint8_t*)tmp_data, l_resp)) {
-			rec_discard_in_ms(Timeout_Comm_Max); continue;
+		// responses of other commands (Cmd_ID_Disable_Output sent by the protection) are skipped
+		bool got_resp = false;
+		while (rec_until((const uint8_t*)&protocol_header, sizeof(protocol_header))
+		&&     rec_fill(sizeof(CommResp))) {
+			// the length is given by ext_length, Resp_Check of older firmwares is shorter
+			uint8_t cmd_id_resp = ((const CommResp*)rec_buf.data())->cmd_id;
+			l_resp = sizeof(CommResp) + ((const CommResp*)rec_buf.data())->ext_length;
+			bool valid = l_resp <= resp_length(cmd_id_resp)
+			          && rec_fill(l_resp) && is_valid_resp(rec_buf.data(), l_resp);
+			if (valid && cmd_id_resp == cmd.cmd_id) {
+				got_resp = true; break;
+			}
+			rec_buf.consume(valid? l_resp : 1); //a broken one is skipped byte by byte
 		}
+		if (! got_resp) continue; //the skipped bytes are not read again
 		
-		// dbg_print_bytes("R", tmp_data, l_resp);
-		suc = (((CommResp*)tmp_data)->resp_val == Resp_OK); break;
+		// dbg_print_bytes("R", rec_buf.data(), l_resp);
+		suc = (((const CommResp*)rec_buf.data())->resp_val == Resp_OK);
+		if (suc) keep_alive(cmd.cmd_id, t_sent);
+		if (suc && rec_data)
+			memcpy(rec_data, rec_buf.data(), l_resp);
+		rec_buf.consume(l_resp); break;
 	}
 	
-	if (suc && rec_data)
-		memcpy(rec_data, tmp_data, l_resp);
-	delete[] tmp_data;
-	
 	return suc;
 }
 
-bool CommLayer::rec_data(uint32_t timeout_ms)
+// in comm_loop(), at least in each Cmd_Poll_Interval. the commands without a response in time are
+// sent again or given up, then queued commands are sent as long as there is room for them.
+// they are written at once with Capability_Cmd_Batch, otherwise each of them is written alone.
+void CommLayer::write_cmds()
 {
-	//look for the header of ADC data block
-	static uint32_t data_header(Data_Header);
-	if (! rec_until((uint8_t*)&data_header, Data_Header_Length, timeout_ms)) return false;
+	steady_clock::time_point t = clk->now();
+	bool batch = hard_param.capabilities & Capability_Cmd_Batch;
+	buf_write.clear(); unsigned int cnt_cmds = 0;
+	auto put = [&](const CommCmd& cmd) -> bool {
+		const uint8_t* p = (const uint8_t*) &cmd;
+		if (! batch) return write(p, cmd_length(cmd.cmd_id), 1);
+		buf_write.insert(buf_write.end(), p, p + cmd_length(cmd.cmd_id)); cnt_cmds++;
+		return true;
+	};
+	
+	for (auto it = cmds_in_flight.begin(); it != cmds_in_flight.end();) {
+		if (t - it->t_sent < milliseconds(Timeout_Comm_Max)) {
+			it++; continue;
+		}
+		bool output = it->cmd.cmd_id == Cmd_ID_PWM_DAC || it->cmd.cmd_id == Cmd_ID_Disable_Output;
+		if (it->cnt_try >= Cmd_Tries_Max || (output && flag_trip)) { //the trip has disabled the output
+			finish_cmd(*it, false); it = cmds_in_flight.erase(it); continue;
+		}
+		put(it->cmd);
+		it->cnt_try++; it->t_sent = t; it++;
+	}
 	
-	int l_rec = serial.ReadBytes((void*)&ad_refint, sizeof(ad_refint), timeout_ms, 1000);
-	if (l_rec < sizeof(ad_refint)) return false;
+	unsigned int cnt_no_resp = 0;
+	while (cmds_in_flight.size() < Cmds_In_Flight_Max) {
+		CmdEntry entry;
+		{
+			lock_guard<mutex> lock(mtx_cmds);
+			if (cmds_queued.empty()) break;
+			entry = cmds_queued.front(); cmds_queued.erase(cmds_queued.begin());
+		}
+		if (entry.cmd.cmd_id == Cmd_ID_PWM_DAC && entry.pwm_dac.dac_val > 0 && flag_trip) {
+			finish_cmd(entry, false); continue; //it was requested before the trip
+		}
+		
+		if (hard_param.capabilities & Capability_Cmd_Seq) {
+			do cmd_seq = cmd_seq % Cmd_Seq_Max + 1;
+			while (any_of(cmds_in_flight.begin(), cmds_in_flight.end(),
+			              [this](const CmdEntry& e) {return e.seq == cmd_seq;}));
+			entry.seq = cmd_seq; entry.cmd.header = protocol_header_seq(cmd_seq);
+		}
+		
+		bool suc = put(entry.cmd);
+		entry.cnt_try = 1; entry.t_sent = entry.t_sent_first = t;
+		if (entry.cmd.cmd_id == Cmd_ID_PWM_DAC && entry.pwm_dac.no_resp) {
+			if (! batch) {
+				finish_cmd(entry, suc); continue;
+			}
+			cnt_no_resp++; //finished after the write
+		}
+		cmds_in_flight.push_back(entry);
+	}
+	if (cnt_cmds == 0) return;
 	
-	l_rec = serial.ReadBytes((void*)adc_raw_data, adc_bulk_data_size(&hard_param),
-	                         timeout_ms, 1000);
-	return l_rec == adc_bulk_data_size(&hard_param);
+	// if it is not written, the commands are sent again after the timeout
+	bool suc = write(buf_write.data(), buf_write.size(), cnt_cmds);
+	for (auto it = cmds_in_flight.begin(); cnt_no_resp > 0 && it != cmds_in_flight.end();) {
+		if (it->cmd.cmd_id != Cmd_ID_PWM_DAC || !it->pwm_dac.no_resp) {
+			it++; continue;
+		}
+		finish_cmd(*it, suc); it = cmds_in_flight.erase(it); cnt_no_resp--;
+	}
 }
 
-static float get_stable_average(const uint16_t* raw_data, unsigned int cnt, float diff_max);
-static float get_average(const float* data, unsigned int cnt);
+// in comm_loop(), between bulks. the latest value given by dac_output() is queued, so the output
+// doesn't change in the middle of a bulk (the averages are not mixed).
+void CommLayer::queue_dac_output()
+{
+	if (! flag_dac_output) return;
+	flag_dac_output = false;
+	if (flag_trip && dac_new_val > 0) return; //it was requested before the trip
+	
+	pwm_dac_conf.dac_val = dac_new_val;
+	if (dac_new_val > 0)
+		submit_cmd(pwm_dac_conf.cmd);
+	else
+		submit_cmd(comm_cmd(Cmd_ID_Disable_Output));
+}
 
-void CommLayer::process_data()
+// every write to the transport is counted here
+bool CommLayer::write(const void* data, uint32_t sz, unsigned int cnt_cmds)
 {
-	if (ad_refint) {
-		buf_vdda.push(vrefint * (float)ADC_Raw_Value_Max / ad_refint);
-		vdda = buf_vdda.get_average();
+	bool suc = transport->write(data, sz);
+	
+	steady_clock::time_point t = clk->now();
+	lock_guard<mutex> lock(mtx_bulks);
+	stat.cnt_writes++; stat.cnt_cmds_written += cnt_cmds;
+	if (t - t_write_rate >= milliseconds(Write_Rate_Interval)) {
+		float ms = duration_cast<microseconds>(t - t_write_rate).count() / 1000.0;
+		stat.writes_per_sec = (stat.cnt_writes - cnt_writes_rate) * 1000.0 / ms;
+		t_write_rate = t; cnt_writes_rate = stat.cnt_writes;
 	}
-	
-	uint16_t* praw = (uint16_t*)adc_raw_data;
-	for (int i = 0; i < hard_param.adc_bulk_data_amount; i++) {
-		adc1_raw_data[i] = praw[2*i];
-		adc2_raw_data[i] = praw[2*i + 1];
+	return suc;
+}
+
+// the callback returns before the future is ready
+void CommLayer::finish_cmd(CmdEntry& entry, bool suc)
+{
+	bool resp = entry.cnt_try > 0 && !(entry.cmd.cmd_id == Cmd_ID_PWM_DAC && entry.pwm_dac.no_resp);
+	if (suc && resp) keep_alive(entry.cmd.cmd_id, entry.t_sent_first);
+	entry.cb_ptr.call(entry.cmd.cmd_id, suc);
+	{
+		lock_guard<mutex> lock(mtx_cmds);
+		entry.st->done = true; entry.st->suc = suc;
 	}
-	
-	uint16_t* p1 = adc1_raw_data, * p2 = adc2_raw_data;
-	for (int i = 0; i < data_amount_per_av_second; i++) {
-		adc1_values[i] = get_stable_average(p1, data_amount_per_av_first, Oversampling_Radius);
-		adc2_values[i] = get_stable_average(p2, data_amount_per_av_first, Oversampling_Radius);
-		p1 += data_amount_per_av_first; p2 += data_amount_per_av_first;
+	clk->notify_all(cv_cmds);
+}
+
+// when comm_loop() returns. commands can't be queued until the threads are started again.
+void CommLayer::fail_cmds()
+{
+	{
+		lock_guard<mutex> lock(mtx_cmds);
+		flag_cmds_open = false; cmds_failed.swap(cmds_queued); //both are reserved
 	}
-	
-	adc1_value = get_average(adc1_values, data_amount_per_av_second);
-	adc2_value = get_average(adc2_values, data_amount_per_av_second);
+	for (CmdEntry& entry : cmds_in_flight) finish_cmd(entry, false);
+	for (CmdEntry& entry : cmds_failed) finish_cmd(entry, false);
+	cmds_in_flight.clear(); cmds_failed.clear();
 }
 
-void CommLayer::rec_discard_in_ms(uint32_t ms)
+// the watchdog may be restarted by the first try, so it is taken as the time
+void CommLayer::keep_alive(uint8_t cmd_id, steady_clock::time_point t_sent)
 {
-	steady_clock::time_point t_end = steady_clock::now() + milliseconds(ms);
-	
-	char ch;
-	while (steady_clock::now() < t_end)
-		serial.ReadChar(&ch, 1);
-	serial.FlushReceiver();
+	if (! is_keep_alive_cmd(cmd_id)) return;
+	lock_guard<mutex> lock(mtx_cmds);
+	if (t_sent > t_keep_alive) t_keep_alive = t_sent;
 }
 
-static bool array_equal(uint8_t* target, const uint8_t* source, uint32_t sz);
-static void bytes_shift_left(uint8_t* bytes, uint32_t sz);
+// matches the response at the beginning of the buffer with a command in flight, by the sequence
+// number if it's supported, otherwise the earliest one with the same ID. returns its length, or
+// 0 if it is not complete, or -1 if it is not a response.
+int CommLayer::rec_resp()
+{
+	if (rec_buf.size() < sizeof(CommResp)) return 0;
+	const CommResp* resp = (const CommResp*) rec_buf.data();
+	uint8_t l_resp = sizeof(CommResp) + resp->ext_length;
+	if (! is_protocol_header(resp->header) || l_resp > resp_length(resp->cmd_id)) return -1;
+	if (rec_buf.size() < l_resp) return 0;
+	if (! is_valid_resp(rec_buf.data(), l_resp)) return -1;
+	
+	uint8_t seq = protocol_header_seq_of(resp->header);
+	for (auto it = cmds_in_flight.begin(); it != cmds_in_flight.end(); it++) {
+		if (it->cmd.cmd_id != resp->cmd_id || it->seq != seq) continue;
+		CmdEntry entry = *it; cmds_in_flight.erase(it);
+		finish_cmd(entry, resp->resp_val == Resp_OK);
+		break;
+	}
+	rec_buf.consume(l_resp); //responses of other commands (including the protection's) are dropped
+	return l_resp;
+}
 
-bool CommLayer::rec_until(const uint8_t* exp_data, uint32_t sz_data, uint32_t timeout_ms)
+static float get_average(const float* data, unsigned int cnt);
+
+// a broken bulk is dropped from its header, the search for the next header (or a response)
+// skips only the bytes which are not one of them. the data is not flushed.
+bool CommLayer::rec_data(uint32_t timeout_ms)
 {
-	if (sz_data == 0) return true;
-	
-	steady_clock::time_point t_start = steady_clock::now();
-	
-	uint8_t* tmp_data = new uint8_t[sz_data];
-	if (serial.ReadBytes((void*)tmp_data, sz_data, timeout_ms, 1000) < sz_data) {
-		delete tmp_data; return false;
+	steady_clock::time_point t_end = clk->now() + milliseconds(timeout_ms);
+	while (true) {
+		if (! rec_header(t_end)) return false;
+		int res = rec_bulk(t_end);
+		if (res >= 0) return res > 0;
+		
+		dbg_print("broken data block");
+		rec_buf.consume(Data_Header_Length);
+		lock_guard<mutex> lock(mtx_bulks);
+		stat.cnt_resyncs++; stat.cnt_bytes_skipped += Data_Header_Length;
+	}
+}
+
+// looks for the header of ADC data block. responses before it are matched, and queued commands
+// are written in the meantime.
+bool CommLayer::rec_header(steady_clock::time_point t_end)
+{
+	const uint32_t data_header = data_header_of(data_format);
+	static const uint8_t resp_begin[2] = {0xff, 0xff};
+	uint32_t cnt_skipped = 0;
+	bool suc = true;
+	while (true) {
+		write_cmds();
+		uint32_t pos_data = rec_buf.find((const uint8_t*)&data_header, Data_Header_Length),
+		         pos_resp = rec_buf.find(resp_begin, sizeof(resp_begin));
+		if (pos_resp < pos_data) {
+			rec_buf.consume(pos_resp); cnt_skipped += pos_resp;
+			int l_resp = rec_resp();
+			if (l_resp < 0) {
+				rec_buf.consume(1); cnt_skipped++;
+			}
+			if (l_resp != 0) continue;
+		} else {
+			rec_buf.consume(pos_data); cnt_skipped += pos_data;
+			if (rec_buf.size() >= Data_Header_Length) break;
+		}
+		
+		uint32_t ms_left = ms_until(t_end), ms_poll = (uint32_t)Cmd_Poll_Interval;
+		if (ms_left == 0 || !rec_more((ms_left < ms_poll)? ms_left : ms_poll)) {
+			suc = false; break;
+		}
 	}
 	
-	while (steady_clock::now() - t_start <= milliseconds(timeout_ms)) {
-		if (array_equal(tmp_data, exp_data, sz_data)) {
-			delete tmp_data; return true;
+	if (cnt_skipped == 0) return suc;
+	lock_guard<mutex> lock(mtx_bulks);
+	stat.cnt_bytes_skipped += cnt_skipped;
+	return suc;
+}
+
+// the header is at the beginning of the buffer. returns 1 if the bulk is received, 0 on timeout,
+// or -1 if it is broken.
+int CommLayer::rec_bulk(steady_clock::time_point t_end)
+{
+	const uint32_t sz_head = Data_Header_Length + sizeof(uint16_t);
+	TripLimits limits;
+	{
+		lock_guard<mutex> lock(mtx_bulks);
+		limits = trip_limits;
+	}
+	bool check = (limits.i_max > 0 || limits.p_mos_max > 0) && limits.r_samp > 0 && limits.div_prop > 0;
+	
+	// each chunk is decoded and averaged as soon as its bytes are received, so the bulk is ready
+	// right after the last byte; the protection checks the chunk before that. the bulk is sent
+	// right after its last sample is taken, so that is the time of the header. the remaining
+	// samples (if the bulk is not divided evenly) are only kept for the raw data.
+	BulkData& bulk = bulks[bulk_rec];
+	steady_clock::time_point t_bulk_end = clk->now();
+	unsigned int cnt_blocks = (bulk_data_amount + data_amount_per_av_first - 1) / data_amount_per_av_first;
+	uint32_t pos = sz_head; //of the current block
+	unsigned int i_chunk = 0;
+	while (i_chunk < cnt_blocks) {
+		uint32_t cnt = data_amount_per_av_first;
+		if (i_chunk == cnt_blocks - 1) cnt = bulk_data_amount - i_chunk * data_amount_per_av_first;
+		
+		// the size of a delta encoded block is known after its first byte (the width)
+		uint32_t sz_block = data_block_size(data_format, cnt, 0);
+		if (data_format == Data_Format_Delta && rec_buf.size() > pos) {
+			uint8_t width = rec_buf.data()[pos];
+			if (width > 12) return -1;
+			sz_block = data_block_size(data_format, cnt, width);
+		} else if (data_format == Data_Format_Delta)
+			sz_block = 1;
+		
+		if (rec_buf.size() < pos + sz_block) {
+			write_cmds();
+			uint32_t ms_left = ms_until(t_end);
+			if (ms_left == 0 || !rec_fill(pos + sz_block, ms_left)) return 0;
+			continue;
+		}
+		
+		// values of the packed formats can't exceed 12 bits, a raw value may do so if bytes are lost
+		// the sums are taken in one pass for all of the checks and averages
+		uint16_t* p_chunk = (uint16_t*)bulk.adc_raw_data + 2 * i_chunk * data_amount_per_av_first;
+		data_block_decode(data_format, rec_buf.data() + pos, cnt, p_chunk);
+		PairStats st; pair_stats(p_chunk, cnt, &st);
+		if (data_format == Data_Format_Raw && !(st.is_valid(0) && st.is_valid(1))) return -1;
+		if (i_chunk < data_amount_per_av_second) {
+			if (check && check_trip(limits, st, i_chunk, t_bulk_end))
+				check = false;
+			get_stable_averages(p_chunk, cnt, st, Oversampling_Radius,
+			                    &bulk.adc1_values[i_chunk], &bulk.adc2_values[i_chunk]);
+			bulk.adc1_sd[i_chunk] = sqrt(st.variance(0, cnt));
+			bulk.adc2_sd[i_chunk] = sqrt(st.variance(1, cnt));
 		}
-		bytes_shift_left(tmp_data, sz_data);
-		if (serial.ReadChar((char*)&tmp_data[sz_data - 1], timeout_ms) != 1) break;
+		pos += sz_block; i_chunk++;
 	}
 	
-	delete tmp_data; return false;
+	uint16_t val_refint; memcpy(&val_refint, rec_buf.data() + Data_Header_Length, sizeof(uint16_t));
+	bulk.ad_refint = val_refint;
+	bulk.cnt_chunks = data_amount_per_av_second;
+	rec_buf.consume(pos);
+	
+	lock_guard<mutex> lock(mtx_bulks);
+	stat.cnt_data_bytes += pos; stat.cnt_data_readings += bulk_data_amount;
+	return 1;
 }
 
-static bool array_equal(uint8_t* target, const uint8_t* source, uint32_t sz)
+// the average of the chunk is checked against the limits, the output is disabled at once if one
+// is exceeded. the response is left in the stream, apply_cmd() skips it.
+bool CommLayer::check_trip(const TripLimits& limits, const PairStats& st, unsigned int i_chunk,
+                           steady_clock::time_point t_bulk_end)
 {
-	for (uint32_t i = 0; i < sz; i++)
-		if (target[i] != source[i]) return false;
+	if (flag_trip || vdac == 0) return false;
+	if (! (st.is_valid(0) && st.is_valid(1))) return false; //broken data
+	
+	float u1 = get_voltage((float)st.sum[0] / data_amount_per_av_first),
+	      u2 = get_voltage((float)st.sum[1] / data_amount_per_av_first);
+	float current = u2 / limits.r_samp,
+	      p_mos = (u1 / limits.div_prop - u2) * current;
+	
+	if (! (limits.i_max > 0 && current > limits.i_max)
+	&&  ! (limits.p_mos_max > 0 && p_mos > limits.p_mos_max))
+		return false;
+	
+	CommCmd cmd = comm_cmd(Cmd_ID_Disable_Output);
+	write(&cmd, cmd_length(cmd.cmd_id), 1);
+	flag_trip = true; vdac = 0;
+	
+	unsigned int cnt_later = data_amount_per_av_second - 1 - i_chunk;
+	steady_clock::time_point t_sample =
+		t_bulk_end - microseconds((long long)(chunk_interval() * 1000 * cnt_later));
+	lock_guard<mutex> lock(mtx_bulks);
+	stat.cnt_trips++;
+	stat.trip_latency.add(clk->now() - t_sample);
+	dbg_print("protection tripped, current: " + to_string(current) + ", MOS power: " + to_string(p_mos));
 	return true;
 }
 
-static void bytes_shift_left(uint8_t* bytes, uint32_t sz)
+// the received bulk takes place of the unprocessed one, if there is, and wakes up process_loop().
+void CommLayer::publish_data()
 {
-	for (uint32_t i = 0; i < sz - 1; i++)
-		bytes[i] = bytes[i + 1];
-	bytes[sz - 1] = 0x00;
+	{
+		lock_guard<mutex> lock(mtx_bulks);
+		bulks[bulk_rec].seq = stat.cnt_bulks_received++;
+		bulks[bulk_rec].seq_chunk = cnt_chunks_received;
+		cnt_chunks_received += bulks[bulk_rec].cnt_chunks;
+		if (flag_data_ready) stat.cnt_bulks_dropped++;
+		bulks[bulk_rec].t_received = clk->now();
+		swap(bulk_rec, bulk_ready);
+		flag_data_ready = true; t_data_ready = bulks[bulk_ready].t_received;
+	}
+	clk->notify_one(cv_bulks);
 }
 
-static float get_stable_average(const uint16_t* raw_data, unsigned int cnt, float diff_max)
+void CommLayer::process_data()
 {
-	if (raw_data == NULL || cnt == 0) return 0;
+	const BulkData& bulk = bulks[bulk_proc];
 	
-	// get the reference average. (without influence of extreme values)
+	if (bulk.ad_refint) {
+		buf_vdda.push(vrefint * (float)ADC_Raw_Value_Max / bulk.ad_refint);
+		vdda = buf_vdda.get_average();
+	}
 	
-	uint16_t* data = new uint16_t[cnt];
-	uint32_t sum = 0;
-	for (uint16_t i = 0; i < cnt; i++) {
-		data[i] = raw_data[i];
-		sum += raw_data[i];
+	// the chunks are averaged by rec_data() while the bulk is being received
+	const uint16_t* praw = (const uint16_t*)bulk.adc_raw_data;
+	for (unsigned int i = 0; i < bulk.cnt_chunks && chunk_callback_ptr.is_set(); i++) {
+		// the bulk is sent right after its last sample is taken
+		unsigned int cnt_later = bulk.cnt_chunks - 1 - i;
+		DataChunk chunk;
+		chunk.seq = bulk.seq_chunk + i;
+		chunk.t = bulk.t_received - microseconds((long long)(chunk_interval() * 1000 * cnt_later));
+		chunk.u1 = get_voltage(bulk.adc1_values[i]); chunk.u2 = get_voltage(bulk.adc2_values[i]);
+		chunk.sd1 = get_voltage(bulk.adc1_sd[i]); chunk.sd2 = get_voltage(bulk.adc2_sd[i]);
+		chunk.raw_pairs = flag_chunk_raw? praw + 2 * data_amount_per_av_first * i : NULL;
+		chunk.cnt_raw_pairs = flag_chunk_raw? data_amount_per_av_first : 0;
+		chunk_callback_ptr.call(chunk);
 	}
 	
-	uint16_t border = cnt / 8; //2*border items will be removed 
-	uint16_t cnt_rem = cnt;
-	uint16_t curr_min = 0, curr_max = 0;
-	uint16_t pmin, pmax;
-	for (uint16_t i = 0; i <= border; i++) {
-		curr_min = UINT16_MAX; curr_max = 0;
-		pmin = pmax = UINT16_MAX;
-		
-		for (uint16_t j = 0; j < cnt; j++) {
-			if (data[j] == UINT16_MAX) continue;
-			if (data[j] < curr_min) {
-				pmin = j;
-				curr_min = data[j];
-			}
-			if (data[j] > curr_max) {
-				pmax = j;
-				curr_max = data[j];
-			}
-		}
+	adc1_value = get_average(bulk.adc1_values, bulk.cnt_chunks);
+	adc2_value = get_average(bulk.adc2_values, bulk.cnt_chunks);
+}
+
+bool CommLayer::rec_fill(uint32_t sz_data, uint32_t timeout_ms)
+{
+	if (rec_buf.size() >= sz_data) return true;
+	rec_buf.reserve(sz_data);
+	
+	steady_clock::time_point t_end = clk->now() + milliseconds(timeout_ms);
+	while (rec_buf.size() < sz_data) {
+		uint32_t ms_left = ms_until(t_end);
+		if (ms_left == 0) return false;
 		
-		if (i == border) break; //at the time curr_min and curr_max are of the remaining data
-		if (pmin == UINT16_MAX || pmax == UINT16_MAX) break; //pmax is invalid in case of all values are 0
-		sum -= raw_data[pmin]; sum -= raw_data[pmax];
-		cnt_rem -= 2;
+		// take everything the port already has in the same read
+		uint32_t sz_space; uint8_t* p = rec_buf.space(&sz_space);
+		uint32_t sz_read = sz_data - rec_buf.size();
+		int cnt_avail = transport->available();
+		if (cnt_avail > 0 && (uint32_t)cnt_avail > sz_read) sz_read = cnt_avail;
+		if (sz_read > sz_space) sz_read = sz_space;
 		
-		data[pmin] = data[pmax] = UINT16_MAX;
+		int l_rec = transport->read(p, sz_read, ms_left);
+		if (l_rec < 0) return false;
+		rec_buf.commit(l_rec);
 	}
-	delete[] data;
-	
-	if ((curr_max - curr_min) / 2 > 8 * diff_max) return 0; //invalid data
-	float av1 = (float)sum / cnt_rem;
+	return true;
+}
+
+bool CommLayer::rec_more(uint32_t timeout_ms)
+{
+	rec_buf.reserve(rec_buf.size() + 1);
+	uint32_t sz_space; uint8_t* p = rec_buf.space(&sz_space);
+	int cnt_avail = transport->available();
+	uint32_t sz_read = (cnt_avail > 0)? cnt_avail : 1;
+	if (sz_read > sz_space) sz_read = sz_space;
+	
+	int l_rec = transport->read(p, sz_read, timeout_ms);
+	if (l_rec < 0) return false;
+	rec_buf.commit(l_rec);
+	return true;
+}
+
+bool CommLayer::rec_until(const uint8_t* exp_data, uint32_t sz_data, uint32_t timeout_ms)
+{
+	if (sz_data == 0) return true;
 	
-	// set the over sampling boundary depending on the reference average calculated above.
-	float av2 = 0;
-	sum = 0; cnt_rem = 0;
-	for (uint16_t i = 0; i < cnt; i++) {
-		if (fabs(raw_data[i] - av1) <= diff_max) {
-			sum += raw_data[i];
-			cnt_rem++;
-		}
+	steady_clock::time_point t_end = clk->now() + milliseconds(timeout_ms);
+	while (true) {
+		// skip the bytes before the expected data (or its beginning at the end of the buffer)
+		rec_buf.consume(rec_buf.find(exp_data, sz_data));
+		if (rec_buf.size() >= sz_data) return true;
+		
+		uint32_t ms_left = ms_until(t_end);
+		if (ms_left == 0 || !rec_fill(sz_data, ms_left)) return false;
 	}
-	if (cnt_rem == 0) return 0;
-	av2 = (float)sum / cnt_rem;
-	return av2;
+}
+
+uint32_t CommLayer::ms_until(steady_clock::time_point t_end) const
+{
+	steady_clock::time_point t = clk->now();
+	if (t >= t_end) return 0;
+	uint32_t ms = duration_cast<milliseconds>(t_end - t).count();
+	return (ms > 0)? ms : 1; //serialib treats timeout 0 as infinite
 }
 
 static float get_average(const float* data, unsigned int cnt)
@@ -6,14 +6,23 @@
 
 #include <chrono>
 #include <thread>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
-#include "serialib/serialib.h"
 #include "simple-cairo-plot/circularbuffer.h"
 #include "comm_protocol.h"
+#include "comm_buffer.h"
+#include "comm_transport.h"
+#include "clock_source.h"
+#include "comm_average.h"
+#include "windowed_stats.h"
 
 using namespace std;
 using namespace std::chrono;
-using SimpleCairoPlot::CircularBuffer;
 
 using DataCallbackAddr = void (*)(void*, float, float);
 
@@ -50,20 +59,248 @@ inline DataCallbackPtr MemberFuncDataCallbackPtr(T* pobj)
 	return DataCallbackPtr(static_cast<void*>(pobj), &MemberFuncDataCallback<T, F>);
 }
 
+// average of a chunk (data_amount_per_av_first samples) in a bulk. the stable averages of all chunks
+// are averaged again for DataCallbackPtr; with ChunkCallbackPtr each of them is delivered.
+struct DataChunk
+{
+	uint64_t seq;                 // counted over all received bulks, gaps mean lost data
+	steady_clock::time_point t;   // estimated time of the last sample in the chunk
+	float u1, u2;                 // voltages of ADC1 and ADC2, 0 if the chunk is invalid
+	float sd1, sd2;               // standard deviations of the readings of ADC1 and ADC2 (V)
+	
+	// interleaved ADC1/ADC2 raw values of the chunk, NULL unless they are requested.
+	// they are only valid in the callback.
+	const uint16_t* raw_pairs; uint32_t cnt_raw_pairs;
+};
+
+using ChunkCallbackAddr = void (*)(void*, const DataChunk&);
+
+class ChunkCallbackPtr
+{
+	void* addr_obj = NULL;
+	ChunkCallbackAddr addr_func = NULL;
+
+public:
+	ChunkCallbackPtr() {}
+	ChunkCallbackPtr(void* pobj, ChunkCallbackAddr pfunc);
+	bool is_set() const;
+	void call(const DataChunk& chunk) const;
+};
+
+inline ChunkCallbackPtr::ChunkCallbackPtr(void* pobj, ChunkCallbackAddr pfunc):
+	addr_obj(pobj), addr_func(pfunc) {}
+
+inline bool ChunkCallbackPtr::is_set() const
+{
+	return addr_func != NULL;
+}
+
+inline void ChunkCallbackPtr::call(const DataChunk& chunk) const
+{
+	if (addr_func == NULL) return;
+	addr_func(addr_obj, chunk);
+}
+
+template <typename T, void (T::*F)(const DataChunk&)>
+void MemberFuncChunkCallback(void* pobj, const DataChunk& chunk)
+{
+	(static_cast<T*>(pobj)->*F)(chunk);
+}
+
+// use this function to create the pointer for a member function.
+template <typename T, void (T::*F)(const DataChunk&)>
+inline ChunkCallbackPtr MemberFuncChunkCallbackPtr(T* pobj)
+{
+	return ChunkCallbackPtr(static_cast<void*>(pobj), &MemberFuncChunkCallback<T, F>);
+}
+
+using CmdCallbackAddr = void (*)(void*, uint8_t, bool);
+
+class CmdCallbackPtr
+{
+	void* addr_obj = NULL;
+	CmdCallbackAddr addr_func = NULL;
+
+public:
+	CmdCallbackPtr() {}
+	CmdCallbackPtr(void* pobj, CmdCallbackAddr pfunc);
+	void call(uint8_t cmd_id, bool suc) const;
+};
+
+inline CmdCallbackPtr::CmdCallbackPtr(void* pobj, CmdCallbackAddr pfunc):
+	addr_obj(pobj), addr_func(pfunc) {}
+
+inline void CmdCallbackPtr::call(uint8_t cmd_id, bool suc) const
+{
+	if (addr_func == NULL) return;
+	addr_func(addr_obj, cmd_id, suc);
+}
+
+template <typename T, void (T::*F)(uint8_t, bool)>
+void MemberFuncCmdCallback(void* pobj, uint8_t cmd_id, bool suc)
+{
+	(static_cast<T*>(pobj)->*F)(cmd_id, suc);
+}
+
+// use this function to create the pointer for a member function.
+template <typename T, void (T::*F)(uint8_t, bool)>
+inline CmdCallbackPtr MemberFuncCmdCallbackPtr(T* pobj)
+{
+	return CmdCallbackPtr(static_cast<void*>(pobj), &MemberFuncCmdCallback<T, F>);
+}
+
+class CommLayer;
+
+// result of a command queued by CommLayer::submit_cmd(). get() blocks (through the clock of CommLayer)
+// until the response is received, the command is given up, or the device is disconnected.
+class CmdFuture
+{
+	friend class CommLayer;
+	struct State {bool done = false, suc = false;};
+	
+	CommLayer* comm = NULL; shared_ptr<State> st;
+
+public:
+	bool valid() const;
+	bool is_ready() const;
+	bool get();
+};
+
+inline bool CmdFuture::valid() const
+{
+	return st != NULL;
+}
+
+// latencies are counted in buckets of powers of 2 microseconds: bucket i holds [2^i, 2^(i+1)) us.
+struct LatencyHistogram
+{
+	enum {Bucket_Count = 32};
+	
+	unsigned long buckets[Bucket_Count] = {0};
+	unsigned long cnt = 0;
+	double sum_us = 0; uint32_t max_us = 0;
+	
+	void add(steady_clock::duration d);
+	void clear();
+	float average_us() const;
+	uint32_t percentile_us(float p) const; //upper bound of the bucket containing the percentile
+};
+
+inline void LatencyHistogram::add(steady_clock::duration d)
+{
+	long long us = duration_cast<microseconds>(d).count();
+	if (us < 0) us = 0;
+	if (us > UINT32_MAX) us = UINT32_MAX;
+	
+	unsigned int i = 0;
+	while ((us >> (i + 1)) && i < Bucket_Count - 1) i++;
+	buckets[i]++; cnt++;
+	sum_us += us; if (us > max_us) max_us = us;
+}
+
+inline void LatencyHistogram::clear()
+{
+	*this = LatencyHistogram();
+}
+
+inline float LatencyHistogram::average_us() const
+{
+	if (cnt == 0) return 0;
+	return sum_us / cnt;
+}
+
+inline uint32_t LatencyHistogram::percentile_us(float p) const
+{
+	unsigned long cnt_p = cnt * p / 100.0, cnt_acc = 0;
+	for (unsigned int i = 0; i < Bucket_Count; i++) {
+		cnt_acc += buckets[i];
+		if (cnt_acc > cnt_p) return (i < 31)? (2u << i) : UINT32_MAX;
+	}
+	return max_us;
+}
+
+struct CommStatistics
+{
+	unsigned long cnt_bulks_received = 0;
+	unsigned long cnt_bulks_dropped = 0; //replaced by a newer bulk before being processed
+	unsigned long long cnt_data_bytes = 0, cnt_data_readings = 0; //for the compression of the data format
+	LatencyHistogram wake_latency; //from a received bulk to the wake-up of the processing thread
+	
+	unsigned long cnt_trips = 0;
+	LatencyHistogram trip_latency; //from the last sample of the chunk exceeding a limit to Cmd_ID_Disable_Output
+	
+	unsigned long cnt_writes = 0, cnt_cmds_written = 0; //writes to the transport, and commands in them
+	float writes_per_sec = 0; //in the last second
+	
+	unsigned long cnt_resyncs = 0; //broken bulks dropped
+	unsigned long long cnt_bytes_skipped = 0; //while looking for a header, after a resync or not
+};
+
+// short bulks lower the latency of the data, long bulks lower the load of USB and CPU.
+// the firmware default is used if the device doesn't support Cmd_ID_ADC_Config.
+enum CommBulkMode
+{
+	Bulk_Default = 0,
+	Bulk_Short,
+	Bulk_Long
+};
+
+// limits of the protection in the receive path. the average of each chunk is checked as soon as its
+// bytes are received, and CommLayer disables the output by itself when a limit is exceeded.
+struct TripLimits
+{
+	float r_samp = 0, div_prop = 0; //see ChargeControlConfig
+	float i_max = 0, p_mos_max = 0; //0 for no limit
+};
+
 class CommLayer
 {
 public:
-	CommLayer();
+	// the system clock and CommTransport::create() are used by default; the transport is deleted by CommLayer.
+	CommLayer(ClockSource* clock = NULL, CommTransport* transport = NULL);
 	~CommLayer();
 	
 	bool is_connected() const;
-	float data_interval() const;
+	bool uses_real_ports() const;
+	float data_interval() const; //of the current bulk mode
+	float chunk_interval() const;
 	float voltage_vrefint() const;
 	float voltage_vdda() const;
+	string serial_number() const; //of the USB device last connected, empty if it's not available
+	CommStatistics comm_statistics() const;
+	
+	// chunks are delivered in the processing thread before the data callback of the same bulk.
+	// it should be set while disconnected.
+	void set_chunk_callback(ChunkCallbackPtr cb_ptr, bool with_raw_data = false);
 	
-	bool connect(DataCallbackPtr cb_ptr);
+	// the format asked for if the device supports the packed formats, Data_Format_Delta by default.
+	// it is applied on the next connection.
+	void set_data_format(uint8_t format);
+	
+	bool connect(DataCallbackPtr cb_ptr); //scans all ports
+	bool connect(DataCallbackPtr cb_ptr, const string& port_name);
 	void disconnect();
-	bool shake();
+	
+	// sends Cmd_ID_Check to the ports, cnt_threads_max of them at a time (as connect() does).
+	// the result is true (non-zero) for each port which has responded.
+	static vector<char> probe_ports(const vector<string>& port_names,
+	                                unsigned int cnt_threads_max = Probe_Threads_Max);
+	
+	// the watchdog of the device is restarted by commands of is_keep_alive_cmd(), shake() is needed only
+	// when none of them has succeeded since keep_alive_time() (the time of sending) for a while.
+	steady_clock::time_point keep_alive_time() const;
+	CmdFuture shake(CmdCallbackPtr cb_ptr = CmdCallbackPtr()); //doesn't wait for the response
+	
+	// the command is sent by the communication thread without waiting for the responses of others.
+	// the callback is called in that thread, so it must not wait for a future. it fails at once
+	// if the device is not connected, or when a newer output command (PWM_DAC, Disable_Output)
+	// takes its place in the queue.
+	CmdFuture submit_cmd(const CommCmd& cmd, CmdCallbackPtr cb_ptr = CmdCallbackPtr());
+	
+	bool bulk_mode_supported() const;
+	void set_bulk_mode(CommBulkMode mode); //applied by the communication thread before the next bulk
+	void set_trip_limits(const TripLimits& limits);
+	bool take_trip(); //returns true once after each trip, DAC output is refused until then
 	bool set_voltage_vrefint(float new_vrefint);
 	float vrefint_calibrate(float v_adc1_actual); //returns new estimation of VRefInt
 	bool dac_output(float val);
@@ -71,41 +308,101 @@ public:
 private:
 	enum {
 		Raw_Data_Interval = 100,
-		Data_Amount_Per_Av_First = 128,
-		Oversampling_Radius = 8
+		Data_Amount_Per_Av_First = Data_Block_Amount, //a chunk is a block of the packed data formats
+		Oversampling_Radius = 8,
+		Probe_Threads_Max = 16,
+		Cmds_In_Flight_Max = 8,
+		Cmds_Queued_Reserve = 32, //the queue can be longer, it's reallocated then
+		Cmd_Poll_Interval = 20, //ms, the longest delay of a queued command while waiting for data
+		Cmd_Tries_Max = 5,
+		Write_Rate_Interval = 1000, //ms, of CommStatistics::writes_per_sec
+		Bulk_Size_Factor = 4 //of short and long bulks
+	};
+	
+	struct PortInfo {
+		string name, serial_number; //serial number of the USB device, if available
+		bool id_matched = false; //USB VID and PID are of the firmware
 	};
 	
-	Serialib::Serial serial;
+	ClockSource* clk;
+	CommTransport* transport;
+	string last_port_name, last_serial_number; //last connected device is probed first
+	RecvBuffer rec_buf;
 	volatile bool flag_connected = false;
 	
 	Resp_Check hard_param;
-	Cmd_ADC_Start adc_conf; float bulk_interval_ms;
+	Cmd_ADC_Start adc_conf; float bulk_interval_ms, chunk_interval_ms;
+	uint16_t bulk_data_amount; //of the current bulk mode
+	uint8_t data_format = Data_Format_Raw; volatile uint8_t data_format_pref = Data_Format_Delta;
 	unsigned int data_amount_per_av_first, data_amount_per_av_second;
+	CommBulkMode bulk_mode = Bulk_Default; volatile CommBulkMode bulk_mode_new = Bulk_Default;
 	
-	Cmd_PWM_DAC pwm_dac_conf = {comm_cmd(Cmd_ID_PWM_DAC), 0, 0, 1, 0, true};
+	// the response doesn't block the pipeline, and it makes the command a keep-alive
+	Cmd_PWM_DAC pwm_dac_conf = {comm_cmd(Cmd_ID_PWM_DAC), 0, 0, 1, 0, false};
 	
 	volatile float vrefint = 0; volatile bool flag_override_vrefint = false;
-	volatile float vdda = 3.3; CircularBuffer buf_vdda; //calculated at this layer
+	volatile float vdda = 3.3; WindowedStats<float, 64> buf_vdda; //calculated at this layer
 	
 	thread* thread_comm = NULL;
 	thread* thread_proc = NULL;
 	
 	volatile bool flag_dac_output = false;
-	float vdac = 0.0; volatile uint16_t dac_new_val;
+	atomic<float> vdac{0}; volatile uint16_t dac_new_val; //vdac is set by dac_output() and check_trip()
 	
-	volatile bool flag_data_ready = false;
-	volatile uint16_t ad_refint; uint8_t* adc_raw_data = NULL;
+	TripLimits trip_limits; //protected by mtx_bulks
+	atomic<bool> flag_trip{false};
+	
+	// bulks are handed from comm_loop() to process_loop() through 3 buffers: one is being received,
+	// one is being processed, the other holds the latest received bulk which is not processed yet.
+	// the averages of the chunks are calculated by comm_loop() while the bulk is being received.
+	struct BulkData {
+		uint16_t ad_refint = 0; uint8_t* adc_raw_data = NULL;
+		float* adc1_values = NULL; float* adc2_values = NULL;
+		float* adc1_sd = NULL; float* adc2_sd = NULL; //of the raw values (LSB)
+		unsigned int cnt_chunks = 0; //data_amount_per_av_second of the bulk mode
+		uint64_t seq = 0, seq_chunk = 0; steady_clock::time_point t_received;
+	};
+	BulkData bulks[3]; unsigned int bulk_rec = 0, bulk_ready = 1, bulk_proc = 2;
+	uint8_t* bulk_arena = NULL; size_t sz_bulk_arena = 0; //kept for the next connection
+	bool flag_data_ready = false; steady_clock::time_point t_data_ready;
+	mutable mutex mtx_bulks; condition_variable cv_bulks;
+	CommStatistics stat; uint64_t cnt_chunks_received = 0;
 	
-	uint16_t* adc1_raw_data; uint16_t* adc2_raw_data;
-	float* adc1_values; float* adc2_values;
 	float adc1_value, adc2_value; unsigned int cnt_zero = 0;
-    
+	
 	DataCallbackPtr callback_ptr;
+	ChunkCallbackPtr chunk_callback_ptr; bool flag_chunk_raw = false;
+	
+	// commands are queued by any thread, and written by comm_loop(). responses are matched with
+	// the ones in flight by the sequence number (with Capability_Cmd_Seq) or by the command ID.
+	struct CmdEntry {
+		union {
+			CommCmd cmd; Cmd_ADC_Start adc_start; Cmd_PWM_DAC pwm_dac; Cmd_ADC_Config adc_config;
+		};
+		uint8_t seq = 0; unsigned int cnt_try = 0; steady_clock::time_point t_sent, t_sent_first;
+		shared_ptr<CmdFuture::State> st; CmdCallbackPtr cb_ptr;
+	};
+	// the vectors are reserved in the constructor, and States of the futures are taken from the pool,
+	// so the commands don't allocate in the steady state. futures must not outlive CommLayer.
+	vector<CmdEntry> cmds_queued; //protected by mtx_cmds
+	vector<CmdEntry> cmds_in_flight, cmds_failed; uint8_t cmd_seq = 0;
+	BlockPool pool_cmd_states;
+	vector<uint8_t> buf_write; //commands written together by write_cmds(), with Capability_Cmd_Batch
+	steady_clock::time_point t_write_rate; unsigned long cnt_writes_rate = 0;
+	bool flag_cmds_open = false; mutable mutex mtx_cmds; condition_variable cv_cmds;
+	steady_clock::time_point t_keep_alive; //protected by mtx_cmds
+	uint16_t bulk_data_amount_pending = 0;
 	
-	volatile bool flag_shake = false, flag_shake_success = false;
 	volatile bool flag_close = false;
 	
+	static PortInfo port_info(const string& port_name);
+	vector<PortInfo> list_ports() const;
+	static bool probe_port(const string& port_name);
+	bool open_port(const string& port_name);
+	void start_threads(DataCallbackPtr cb_ptr);
 	bool adc_config();
+	uint16_t bulk_amount(CommBulkMode mode) const;
+	void apply_bulk_mode(CommBulkMode mode);
 	
 	void comm_loop();
 	void process_loop();
@@ -113,37 +410,127 @@ private:
 	inline bool apply_cmd(uint8_t cmd_id, CommResp* rec_data = NULL);
 	bool apply_cmd(const CommCmd& cmd, CommResp* rec_data = NULL);
 	
+	void write_cmds();
+	void queue_dac_output();
+	bool write(const void* data, uint32_t sz, unsigned int cnt_cmds);
+	void finish_cmd(CmdEntry& entry, bool suc);
+	void fail_cmds();
+	void keep_alive(uint8_t cmd_id, steady_clock::time_point t_sent);
+	int rec_resp();
+	void bulk_config_callback(uint8_t cmd_id, bool suc);
+	
 	bool rec_data(uint32_t timeout_ms);
+	bool rec_header(steady_clock::time_point t_end);
+	int rec_bulk(steady_clock::time_point t_end);
+	bool check_trip(const TripLimits& limits, const PairStats& st, unsigned int i_chunk,
+	                steady_clock::time_point t_bulk_end);
+	void publish_data();
+	bool rec_fill(uint32_t sz_data, uint32_t timeout_ms = Timeout_Comm_Max);
+	bool rec_more(uint32_t timeout_ms); //false on failure of the transport
 	bool rec_until(const uint8_t* exp_data, uint32_t sz_data,
 	               uint32_t timeout_ms = Timeout_Comm_Max);
-	void rec_discard_in_ms(uint32_t ms);
+	uint32_t ms_until(steady_clock::time_point t_end) const;
 	
 	void process_data();
 	
 	float get_voltage(float val);
 	uint16_t from_voltage(float val);
+	
+	friend class CmdFuture;
+	bool wait_cmd(const shared_ptr<CmdFuture::State>& st);
 };
 
+inline bool CmdFuture::is_ready() const
+{
+	if (! st) return false;
+	lock_guard<mutex> lock(comm->mtx_cmds);
+	return st->done;
+}
+
+inline bool CmdFuture::get()
+{
+	if (! st) return false;
+	return comm->wait_cmd(st);
+}
+
 inline bool CommLayer::is_connected() const
 {
 	return flag_connected;
 }
 
+inline steady_clock::time_point CommLayer::keep_alive_time() const
+{
+	lock_guard<mutex> lock(mtx_cmds);
+	return t_keep_alive;
+}
+
+inline bool CommLayer::uses_real_ports() const
+{
+	return ! transport->is_replay();
+}
+
 inline float CommLayer::data_interval() const
 {
 	return bulk_interval_ms;
 }
 
+inline float CommLayer::chunk_interval() const
+{
+	return chunk_interval_ms;
+}
+
+inline bool CommLayer::bulk_mode_supported() const
+{
+	return hard_param.capabilities & Capability_ADC_Config;
+}
+
+inline void CommLayer::set_bulk_mode(CommBulkMode mode)
+{
+	bulk_mode_new = mode;
+}
+
+inline void CommLayer::set_chunk_callback(ChunkCallbackPtr cb_ptr, bool with_raw_data)
+{
+	chunk_callback_ptr = cb_ptr; flag_chunk_raw = with_raw_data;
+}
+
+inline void CommLayer::set_data_format(uint8_t format)
+{
+	if (format <= Data_Format_Delta) data_format_pref = format;
+}
+
 inline float CommLayer::voltage_vdda() const
 {
 	return vdda;
 }
 
+inline string CommLayer::serial_number() const
+{
+	return last_serial_number;
+}
+
 inline float CommLayer::voltage_vrefint() const
 {
 	return vrefint;
 }
 
+inline CommStatistics CommLayer::comm_statistics() const
+{
+	lock_guard<mutex> lock(mtx_bulks);
+	return stat;
+}
+
+inline void CommLayer::set_trip_limits(const TripLimits& limits)
+{
+	lock_guard<mutex> lock(mtx_bulks);
+	trip_limits = limits;
+}
+
+inline bool CommLayer::take_trip()
+{
+	return flag_trip.exchange(false);
+}
+
 inline bool CommLayer::set_voltage_vrefint(float new_vrefint)
 {
 	if (new_vrefint < 0.1 || new_vrefint > 4.8) return false;
@@ -160,17 +547,26 @@ inline float CommLayer::vrefint_calibrate(float v_adc1_actual)
 	
 	float d = v_adc1_actual / get_voltage(adc1_value);
 	vrefint *= d; vdda *= d;
-	buf_vdda.clear(true); buf_vdda.push(vdda);
+	buf_vdda.clear(); buf_vdda.push(vdda);
 	return vrefint;
 }
 
 inline CommLayer::~CommLayer()
 {
 	if (flag_connected) disconnect();
+	delete transport;
+	delete[] bulk_arena;
 }
 
 // private functions
 
+inline bool CommLayer::wait_cmd(const shared_ptr<CmdFuture::State>& st)
+{
+	unique_lock<mutex> lock(mtx_cmds);
+	clk->wait(cv_cmds, lock, [&st] {return st->done;});
+	return st->suc;
+}
+
 inline bool CommLayer::apply_cmd(uint8_t cmd_id, CommResp* rec_data)
 {
 	CommCmd cmd = comm_cmd(cmd_id);
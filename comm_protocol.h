@@ -6,13 +6,18 @@
 
 #ifdef __cplusplus
 	#include <cstdint>
+	#include <cstddef>
 #else
 	#include "stdint.h"
+	#include "stddef.h"
 	#ifndef bool
 		#include "stdbool.h"
 	#endif
 #endif
 
+#define USB_Vendor_ID   0x0483 // USB device descriptor of the CDC-ACM firmware
+#define USB_Product_ID  0x5740
+
 #define Protocol_Header 0x0000ffff // 0x ff ff 00 00
 #define Protocol_Key    0x20220914 // 0x 14 09 22 20
 
@@ -22,17 +27,45 @@
 #define Cmd_ID_PWM_DAC        ((uint8_t) 0x04)
 #define Cmd_ID_Disable_Output ((uint8_t) 0x05)
 #define Cmd_ID_Shake          ((uint8_t) 0x06)
+#define Cmd_ID_ADC_Config     ((uint8_t) 0x07) // only with Capability_ADC_Config
 #define Cmd_ID_Unlock         ((uint8_t) 0xfe)
 #define Cmd_ID_Reset          ((uint8_t) 0xff)
 
 #define Resp_OK               ((uint8_t) 0x00)
 #define Resp_Failed           ((uint8_t) 0x01)
 
+// flags in Resp_Check->capabilities
+#define Capability_ADC_Config ((uint8_t) 0x01)
+#define Capability_Data_Packed ((uint8_t) 0x02) // Data_Format_Packed and Data_Format_Delta (by Cmd_ID_ADC_Config)
+#define Capability_Cmd_Seq    ((uint8_t) 0x04)
+#define Capability_Cmd_Batch  ((uint8_t) 0x08) // several commands in one packet, taken in order
+
+// with Capability_Cmd_Seq, the third byte of the header of a command (0 in Protocol_Header) can be
+// a sequence number (1 ~ Cmd_Seq_Max), and the response has the same header. so the host can send
+// commands without waiting for the responses of the previous ones.
+#define Cmd_Seq_Max 127
+
+// without Capability_Cmd_Batch, a packet (USB transfer) must be exactly one command, otherwise
+// it is answered with failure (cmd_id 0) as a whole.
+
 // the data block consists of this 32-bit header, then 16-bit AD_RefInt value,
 // then adc_bulk_data_amount * (16b(ADC1) + 16b(ADC2)).
 #define Data_Header_Length 4
 #define Data_Header 0xffffffee // 0x ee ff ff ff
 
+// formats of the data block. the packed ones have their own headers, and the readings after AD_RefInt
+// are divided into blocks of Data_Block_Amount readings (the last one might be shorter):
+// Data_Format_Packed: each reading is 12b(ADC1) + 12b(ADC2) in 3 bytes, little-endian.
+// Data_Format_Delta: each block begins with 8-bit width (0 ~ 12) and the first reading packed as above,
+//                    then the differences (modulo 4096) from the previous reading of ADC1 and ADC2,
+//                    zigzag encoded in `width` bits each, LSB first. the block is padded to bytes.
+#define Data_Format_Raw    ((uint8_t) 0x00)
+#define Data_Format_Packed ((uint8_t) 0x01)
+#define Data_Format_Delta  ((uint8_t) 0x02)
+#define Data_Header_Packed 0xffffffed // 0x ed ff ff ff
+#define Data_Header_Delta  0xffffffec // 0x ec ff ff ff
+#define Data_Block_Amount  128
+
 #define ADC_Raw_Value_Max     ((uint16_t) 4095)
 #define DAC_Raw_Value_Max     ((uint16_t) 4095)
 
@@ -40,6 +73,9 @@
 #define Timeout_Data_Max      1000 //ms
 #define Shake_Interval_Max   10000 //ms, the MCU should disable DAC output when it is exceeded
 
+// the interval is restarted by any valid command. older firmwares restart it only by the commands
+// given by is_keep_alive_cmd(), so the host relies on these.
+
 #pragma pack(push, 1) //disable aligning (supported by MSVC, GCC and Clang)
 
 typedef struct {
@@ -66,6 +102,10 @@ typedef struct {
 	uint16_t adc_clock_cycles_opts[16]; // options in ascending order, unavailable options should be 0
 	uint16_t adc_bulk_data_amount;      // each "element" consist of readings of both channels (4B)
 	uint16_t adc_vrefint;               // internal reference voltage (mV)
+	
+	// older firmwares end the response here (see resp_length_min()), these fields are 0 then.
+	uint8_t  capabilities;              // Capability_XXX flags
+	uint16_t adc_bulk_data_amount_max;  // for Cmd_ID_ADC_Config, the default is adc_bulk_data_amount
 } Resp_Check;
 
 typedef struct {
@@ -85,13 +125,30 @@ typedef struct {
 	bool     no_resp;                  // do not response
 } Cmd_PWM_DAC;
 
+// changes the amount of data in each bulk and the sampling interval. it takes effect at once:
+// if ADC is running, the bulk being converted is dropped and the conversion is restarted.
+// the bulk amount is kept until Cmd_ID_Reset, Cmd_ID_ADC_Start still sets the sampling interval.
+typedef struct {
+	CommCmd  cmd;
+	uint16_t adc_bulk_data_amount;     // 1 ~ Resp_Check->adc_bulk_data_amount_max
+	uint8_t  adc_clock_cycles_opt;     // same as Cmd_ADC_Start->adc_clock_cycles_opt
+	uint8_t  data_format;              // Data_Format_XXX, the packed ones need Capability_Data_Packed
+} Cmd_ADC_Config;
+
 #pragma pack(pop) //recover previous align mode
 
+static inline uint32_t protocol_header_seq(uint8_t seq);
+static inline uint8_t protocol_header_seq_of(uint32_t header);
+static inline bool is_protocol_header(uint32_t header);
+
 static inline uint8_t cmd_length(uint8_t cmd_id);
+static inline bool is_keep_alive_cmd(uint8_t cmd_id);
+
 static inline CommCmd comm_cmd(uint8_t cmd_id);
 static inline bool is_valid_cmd(const uint8_t* ptr, uint8_t length);
 
 static inline uint8_t resp_length(uint8_t cmd_id);
+static inline uint8_t resp_length_min(uint8_t cmd_id);
 static inline CommResp comm_resp(uint8_t cmd_id, uint8_t resp_val);
 static inline bool is_valid_resp(const uint8_t* ptr, uint8_t length);
 
@@ -100,8 +157,29 @@ static inline float adc_raw_data_interval_ms(const Resp_Check* hard_param, uint8
 static inline float adc_bulk_interval_ms(const Resp_Check* hard_param, uint8_t opt);
 static uint8_t choose_adc_clock_cycles_opt(const Resp_Check* hard_param, float interval_ms);
 
+static inline uint32_t data_header_of(uint8_t data_format);
+static inline uint32_t data_block_size(uint8_t data_format, uint32_t cnt, uint8_t width);
+static inline void data_pack_12b(const uint16_t* pairs, uint32_t cnt, uint8_t* dst);
+static inline uint32_t data_block_encode(uint8_t data_format, const uint16_t* pairs, uint32_t cnt, uint8_t* dst);
+
 // function definitions
 
+static inline uint32_t protocol_header_seq(uint8_t seq)
+{
+	return Protocol_Header | ((uint32_t)seq << 16);
+}
+
+static inline uint8_t protocol_header_seq_of(uint32_t header)
+{
+	return (header >> 16) & 0xff;
+}
+
+// Protocol_Header, or with a sequence number
+static inline bool is_protocol_header(uint32_t header)
+{
+	return (header & 0xff00ffff) == Protocol_Header && protocol_header_seq_of(header) <= Cmd_Seq_Max;
+}
+
 static inline uint8_t cmd_length(uint8_t cmd_id)
 {
 	switch (cmd_id) {
@@ -112,11 +190,20 @@ static inline uint8_t cmd_length(uint8_t cmd_id)
 			return sizeof(Cmd_ADC_Start);
 		case Cmd_ID_PWM_DAC:
 			return sizeof(Cmd_PWM_DAC);
+		case Cmd_ID_ADC_Config:
+			return sizeof(Cmd_ADC_Config);
 		default:
 			return 0;
 	}
 }
 
+// the commands which restart the shake countdown of the firmware
+static inline bool is_keep_alive_cmd(uint8_t cmd_id)
+{
+	return cmd_id == Cmd_ID_ADC_Start || cmd_id == Cmd_ID_PWM_DAC
+	    || cmd_id == Cmd_ID_Disable_Output || cmd_id == Cmd_ID_Shake;
+}
+
 static inline CommCmd comm_cmd(uint8_t cmd_id)
 {
 	CommCmd cmd = {Protocol_Header, cmd_id,
@@ -129,7 +216,7 @@ static inline bool is_valid_cmd(const uint8_t* ptr, uint8_t length)
 	const CommCmd* cmd = (const CommCmd*) ptr;
 	
 	if (length < sizeof(CommCmd)
-	||  cmd->header != Protocol_Header
+	||  ! is_protocol_header(cmd->header)
 	||  ! cmd_length(cmd->cmd_id)
 	||  length != sizeof(CommCmd) + cmd->ext_length
 	||  length != cmd_length(cmd->cmd_id))
@@ -143,6 +230,13 @@ static inline bool is_valid_cmd(const uint8_t* ptr, uint8_t length)
 		if (cmd_pwm_dac->dac_val > 4095)
 			return false;
 	}
+	if (cmd->cmd_id == Cmd_ID_ADC_Config) {
+		Cmd_ADC_Config* cmd_adc_config = (Cmd_ADC_Config*) cmd;
+		if (cmd_adc_config->adc_bulk_data_amount == 0
+		||  cmd_adc_config->adc_clock_cycles_opt > 15
+		||  cmd_adc_config->data_format > Data_Format_Delta)
+			return false;
+	}
 	
 	return true;
 }
@@ -155,6 +249,14 @@ static inline uint8_t resp_length(uint8_t cmd_id)
 		return sizeof(CommResp);
 }
 
+static inline uint8_t resp_length_min(uint8_t cmd_id)
+{
+	if (cmd_id == Cmd_ID_Check)
+		return offsetof(Resp_Check, capabilities);
+	else
+		return sizeof(CommResp);
+}
+
 static inline CommResp comm_resp(uint8_t cmd_id, uint8_t resp_val)
 {
 	CommResp resp = {Protocol_Header, cmd_id, resp_val,
@@ -167,11 +269,12 @@ static inline bool is_valid_resp(const uint8_t* ptr, uint8_t length)
 	const CommResp* resp = (const CommResp*) ptr;
 	
 	if (length < sizeof(CommResp)
-	||  resp->header != Protocol_Header
+	||  ! is_protocol_header(resp->header)
 	||  ! cmd_length(resp->cmd_id)
 	||  (resp->resp_val != Resp_OK && resp->resp_val != Resp_Failed)
 	||  length != sizeof(CommResp) + resp->ext_length
-	||  length != resp_length(resp->cmd_id))
+	||  length < resp_length_min(resp->cmd_id)
+	||  length > resp_length(resp->cmd_id))
 		return false;
 	
 	if (resp->cmd_id == Cmd_ID_Check) {
@@ -183,6 +286,10 @@ static inline bool is_valid_resp(const uint8_t* ptr, uint8_t length)
 		||  ! resp_check->adc_bulk_data_amount
 		||  ! resp_check->adc_vrefint)
 			return false;
+		if (length == sizeof(Resp_Check)
+		&&  (resp_check->capabilities & Capability_ADC_Config)
+		&&  resp_check->adc_bulk_data_amount_max < resp_check->adc_bulk_data_amount)
+			return false;
 	}
 	
 	return true;
@@ -227,4 +334,69 @@ static uint8_t choose_adc_clock_cycles_opt(const Resp_Check* hard_param, float i
 		return opt_r;
 }
 
+static inline uint32_t data_header_of(uint8_t data_format)
+{
+	switch (data_format) {
+		case Data_Format_Packed: return Data_Header_Packed;
+		case Data_Format_Delta:  return Data_Header_Delta;
+		default:                 return Data_Header;
+	}
+}
+
+// size of a block of cnt readings, the width is only used by Data_Format_Delta
+static inline uint32_t data_block_size(uint8_t data_format, uint32_t cnt, uint8_t width)
+{
+	switch (data_format) {
+		case Data_Format_Packed: return 3 * cnt;
+		case Data_Format_Delta:  return 1 + 3 + (2 * (cnt - 1) * width + 7) / 8;
+		default:                 return 2 * 2 * cnt;
+	}
+}
+
+static inline void data_pack_12b(const uint16_t* pairs, uint32_t cnt, uint8_t* dst)
+{
+	for (uint32_t i = 0; i < cnt; i++, pairs += 2, dst += 3) {
+		dst[0] = pairs[0] & 0xff;
+		dst[1] = ((pairs[0] >> 8) & 0x0f) | ((pairs[1] & 0x0f) << 4);
+		dst[2] = (pairs[1] >> 4) & 0xff;
+	}
+}
+
+// writes a block of cnt (1 ~ Data_Block_Amount) readings, returns its size
+static inline uint32_t data_block_encode(uint8_t data_format, const uint16_t* pairs, uint32_t cnt, uint8_t* dst)
+{
+	if (data_format == Data_Format_Raw) {
+		for (uint32_t i = 0; i < 2 * cnt; i++) { //little-endian
+			dst[2*i] = pairs[i] & 0xff; dst[2*i + 1] = pairs[i] >> 8;
+		}
+		return 2 * 2 * cnt;
+	}
+	if (data_format == Data_Format_Packed) {
+		data_pack_12b(pairs, cnt, dst); return 3 * cnt;
+	}
+	
+	// the width is decided by the largest difference in the block
+	uint16_t zz_max = 0;
+	for (uint32_t i = 2; i < 2 * cnt; i++) {
+		int16_t d = (int16_t)((uint16_t)(pairs[i] - pairs[i - 2]) << 4) >> 4; //sign extended 12 bits
+		uint16_t zz = ((uint16_t)((uint16_t)d << 1) ^ (uint16_t)(d >> 15)) & 0x0fff;
+		if (zz > zz_max) zz_max = zz;
+	}
+	uint8_t width = 0;
+	while (zz_max >> width) width++;
+	
+	dst[0] = width; data_pack_12b(pairs, 1, dst + 1);
+	uint32_t sz = data_block_size(Data_Format_Delta, cnt, width);
+	uint8_t* p = dst + 4; uint32_t acc = 0; uint8_t cnt_bits = 0;
+	for (uint32_t i = 2; i < 2 * cnt; i++) {
+		int16_t d = (int16_t)((uint16_t)(pairs[i] - pairs[i - 2]) << 4) >> 4;
+		acc |= (uint32_t)(((uint16_t)((uint16_t)d << 1) ^ (uint16_t)(d >> 15)) & 0x0fff) << cnt_bits; cnt_bits += width;
+		while (cnt_bits >= 8) {
+			*(p++) = acc & 0xff; acc >>= 8; cnt_bits -= 8;
+		}
+	}
+	if (cnt_bits > 0) *p = acc & 0xff;
+	return sz;
+}
+
 #endif
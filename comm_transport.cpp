@@ -0,0 +1,359 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#include "comm_transport.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+const char Capture_Magic[8] = {'U', 'C', 'C', 'C', 'A', 'P', '0', '1'};
+
+CommTransport* CommTransport::create()
+{
+	const char* path_replay = getenv("USB_CHARGE_REPLAY");
+	if (path_replay && *path_replay) {
+		const char* speed = getenv("USB_CHARGE_REPLAY_SPEED");
+		return new ReplayTransport(path_replay, speed && string(speed) == "max");
+	}
+	
+	const char* path_capture = getenv("USB_CHARGE_CAPTURE");
+	if (path_capture && *path_capture)
+		return new CaptureTransport(path_capture);
+	
+	return new SerialTransport();
+}
+
+/*------------------------------ SerialTransport ------------------------------*/
+
+bool SerialTransport::open(const string& port_name)
+{
+	int open_result = serial.OpenDevice(port_name.c_str(), 9600);
+	if (open_result != 1) { //error
+		if (open_result != -1 && open_result != -2)
+			serial.CloseDevice();
+		return false;
+	}
+	return true;
+}
+
+void SerialTransport::close()
+{
+	serial.CloseDevice();
+}
+
+bool SerialTransport::write(const void* data, uint32_t sz)
+{
+	return serial.WriteBytes((void*)data, sz) == 1;
+}
+
+int SerialTransport::read(void* buf, uint32_t sz, uint32_t timeout_ms)
+{
+	int l_rec = serial.ReadBytes(buf, sz, timeout_ms, 1000);
+	return (l_rec < 0)? -1 : l_rec;
+}
+
+int SerialTransport::available()
+{
+	return serial.Available();
+}
+
+void SerialTransport::flush_receiver()
+{
+	serial.FlushReceiver();
+}
+
+/*------------------------------ CaptureTransport ------------------------------*/
+
+CaptureTransport::CaptureTransport(const string& path): file_path(path) {}
+
+bool CaptureTransport::open(const string& port_name)
+{
+	if (! SerialTransport::open(port_name)) return false;
+	
+	// each connection overwrites the file, so it holds the last session
+	ofs.close();
+	ofs.open(file_path, ios::binary | ios::trunc);
+	if (ofs) ofs.write(Capture_Magic, sizeof(Capture_Magic));
+	t_last = steady_clock::now();
+	return true;
+}
+
+void CaptureTransport::close()
+{
+	SerialTransport::close();
+	ofs.close();
+}
+
+bool CaptureTransport::write(const void* data, uint32_t sz)
+{
+	bool suc = SerialTransport::write(data, sz);
+	if (suc) record(Capture_Dir_Sent, data, sz);
+	return suc;
+}
+
+int CaptureTransport::read(void* buf, uint32_t sz, uint32_t timeout_ms)
+{
+	int l_rec = SerialTransport::read(buf, sz, timeout_ms);
+	if (l_rec > 0) record(Capture_Dir_Received, buf, l_rec);
+	return l_rec;
+}
+
+void CaptureTransport::record(uint8_t dir, const void* data, uint32_t sz)
+{
+	if (! ofs) return;
+	
+	steady_clock::time_point t = steady_clock::now();
+	uint64_t dt = duration_cast<microseconds>(t - t_last).count();
+	uint32_t dt_us = (dt > UINT32_MAX)? UINT32_MAX : dt;
+	t_last = t;
+	
+	const uint8_t* p = (const uint8_t*) data;
+	while (sz > 0) {
+		uint16_t len = (sz > UINT16_MAX)? UINT16_MAX : sz;
+		ofs.write((const char*)&dt_us, sizeof(dt_us));
+		ofs.write((const char*)&dir, sizeof(dir));
+		ofs.write((const char*)&len, sizeof(len));
+		ofs.write((const char*)p, len);
+		p += len; sz -= len; dt_us = 0;
+	}
+}
+
+/*------------------------------ ReplayTransport ------------------------------*/
+
+ReplayTransport::ReplayTransport(const string& path, bool max_speed):
+	file_path(path), max_speed(max_speed) {}
+
+bool ReplayTransport::load()
+{
+	ifstream ifs(file_path, ios::binary);
+	char magic[sizeof(Capture_Magic)];
+	if (! ifs.read(magic, sizeof(magic)) || memcmp(magic, Capture_Magic, sizeof(magic)) != 0)
+		return false;
+	
+	data.clear(); chunks.clear(); adc_configs.clear();
+	vector<uint8_t> sent;
+	uint64_t t_us = 0;
+	uint32_t dt_us; uint8_t dir; uint16_t len;
+	while (ifs.read((char*)&dt_us, sizeof(dt_us))
+	&&     ifs.read((char*)&dir, sizeof(dir))
+	&&     ifs.read((char*)&len, sizeof(len))) {
+		t_us += dt_us;
+		if (dir != Capture_Dir_Received) {
+			sent.resize(len);
+			if (! ifs.read((char*)sent.data(), len)) break;
+			if (dir == Capture_Dir_Sent) load_sent(sent.data(), len);
+			continue;
+		}
+		Chunk chunk = {t_us, (uint32_t)data.size(), len};
+		data.resize(data.size() + len);
+		if (! ifs.read((char*)&data[chunk.pos], len)) {
+			data.resize(chunk.pos); break;
+		}
+		chunks.push_back(chunk);
+	}
+	
+	// find the recorded response of Cmd_ID_Check, its length is given by ext_length. the bulks are
+	// replayed as they are recorded, so the recorded capabilities are offered, and Cmd_ID_ADC_Config
+	// is only accepted with a recorded configuration. the recorded responses carry the sequence
+	// numbers of the recorded commands, so Capability_Cmd_Seq is not offered.
+	CommResp resp = comm_resp(Cmd_ID_Check, Resp_OK);
+	const uint32_t sz_head = sizeof(CommResp) - 1; //without ext_length
+	resp_check.clear();
+	for (uint32_t i = 0; i + sizeof(CommResp) <= data.size(); i++) {
+		uint8_t l_resp = sizeof(CommResp) + data[i + sz_head];
+		if (memcmp(&data[i], &resp, sz_head) == 0 && i + l_resp <= data.size()
+		&&  is_valid_resp(&data[i], l_resp)) {
+			resp_check.assign(&data[i], &data[i] + l_resp);
+			if (l_resp == sizeof(Resp_Check))
+				resp_check[offsetof(Resp_Check, capabilities)] &= ~Capability_Cmd_Seq;
+			break;
+		}
+	}
+	return ! resp_check.empty();
+}
+
+// Cmd_ID_ADC_Config commands written by the host while recording (valid ones, without duplicates)
+void ReplayTransport::load_sent(const uint8_t* p, uint32_t sz)
+{
+	while (sz >= sizeof(CommCmd)) {
+		uint8_t length = cmd_length(((const CommCmd*)p)->cmd_id);
+		if (length == 0 || length > sz) break;
+		if (((const CommCmd*)p)->cmd_id == Cmd_ID_ADC_Config && is_valid_cmd(p, length)) {
+			const Cmd_ADC_Config* cmd = (const Cmd_ADC_Config*) p;
+			if (! recorded_adc_config(cmd)) adc_configs.push_back(*cmd);
+		}
+		p += length; sz -= length;
+	}
+}
+
+bool ReplayTransport::recorded_adc_config(const Cmd_ADC_Config* cmd) const
+{
+	for (const Cmd_ADC_Config& conf : adc_configs)
+		if (conf.adc_bulk_data_amount == cmd->adc_bulk_data_amount && conf.data_format == cmd->data_format)
+			return true;
+	return false;
+}
+
+// the capture is played once; the transport can't be opened again after that.
+bool ReplayTransport::open(const string& port_name)
+{
+	if (flag_played || !load()) return false;
+	flag_played = true;
+	i_chunk = 0; pos_chunk = 0; resp_pending.clear();
+	t_start = steady_clock::now();
+	return true;
+}
+
+void ReplayTransport::close()
+{
+	data.clear(); chunks.clear();
+	i_chunk = 0; pos_chunk = 0;
+}
+
+// several commands may be written together (Capability_Cmd_Batch), each of them is answered
+bool ReplayTransport::write(const void* data, uint32_t sz)
+{
+	const uint8_t* p = (const uint8_t*) data;
+	while (sz >= sizeof(CommCmd)) {
+		uint8_t length = cmd_length(((const CommCmd*)p)->cmd_id);
+		if (length == 0 || length > sz) break; //the MCU would report failure
+		if (is_valid_cmd(p, length)) answer((const CommCmd*)p);
+		p += length; sz -= length;
+	}
+	return true;
+}
+
+void ReplayTransport::answer(const CommCmd* cmd)
+{
+	if (cmd->cmd_id == Cmd_ID_PWM_DAC && ((const Cmd_PWM_DAC*)cmd)->no_resp)
+		return;
+	
+	uint32_t pos = resp_pending.size();
+	if (cmd->cmd_id == Cmd_ID_Check)
+		resp_pending.insert(resp_pending.end(), resp_check.begin(), resp_check.end());
+	else {
+		bool ok = cmd->cmd_id != Cmd_ID_ADC_Config || recorded_adc_config((const Cmd_ADC_Config*)cmd);
+		CommResp resp = comm_resp(cmd->cmd_id, ok? Resp_OK : Resp_Failed);
+		resp_pending.insert(resp_pending.end(), (uint8_t*)&resp, (uint8_t*)&resp + sizeof(resp));
+	}
+	memcpy(&resp_pending[pos], &cmd->header, sizeof(cmd->header)); //with the sequence number
+}
+
+inline bool ReplayTransport::is_due(const Chunk& chunk) const
+{
+	return max_speed || steady_clock::now() >= t_start + microseconds(chunk.t_us);
+}
+
+int ReplayTransport::read(void* buf, uint32_t sz, uint32_t timeout_ms)
+{
+	steady_clock::time_point t_end = steady_clock::now() + milliseconds(timeout_ms);
+	
+	uint8_t* p = (uint8_t*) buf; uint32_t cnt = 0;
+	if (! resp_pending.empty()) {
+		cnt = (resp_pending.size() < sz)? resp_pending.size() : sz;
+		memcpy(p, resp_pending.data(), cnt);
+		resp_pending.erase(resp_pending.begin(), resp_pending.begin() + cnt);
+	}
+	
+	while (cnt < sz && i_chunk < chunks.size()) {
+		const Chunk& chunk = chunks[i_chunk];
+		if (! is_due(chunk)) {
+			steady_clock::time_point t_due = t_start + microseconds(chunk.t_us);
+			if (t_due > t_end) {
+				this_thread::sleep_until(t_end); break;
+			}
+			this_thread::sleep_until(t_due);
+		}
+		
+		uint32_t l = chunk.len - pos_chunk;
+		if (l > sz - cnt) l = sz - cnt;
+		memcpy(p + cnt, &data[chunk.pos + pos_chunk], l);
+		cnt += l; pos_chunk += l;
+		if (pos_chunk == chunk.len) {
+			i_chunk++; pos_chunk = 0;
+		}
+	}
+	return cnt;
+}
+
+int ReplayTransport::available()
+{
+	int cnt = resp_pending.size();
+	for (unsigned int i = i_chunk; i < chunks.size() && is_due(chunks[i]); i++) {
+		cnt += chunks[i].len - ((i == i_chunk)? pos_chunk : 0);
+		if (max_speed && cnt >= 65536) break; //it's enough for one read
+	}
+	return cnt;
+}
+
+void ReplayTransport::flush_receiver()
+{
+	resp_pending.clear();
+	
+	// bytes which should have arrived are dropped
+	while (i_chunk < chunks.size() && !max_speed && is_due(chunks[i_chunk])) {
+		i_chunk++; pos_chunk = 0;
+	}
+}
+
+/*------------------------------ SimTransport ------------------------------*/
+
+SimTransport::SimTransport(ClockSource* clock, const EmuConfig& conf, unsigned int seed):
+	clock(clock), dev(conf, seed) {}
+
+// the device keeps its state (and the battery) between connections, like the real one
+bool SimTransport::open(const string& port_name)
+{
+	flush_receiver();
+	return true;
+}
+
+void SimTransport::close() {}
+
+bool SimTransport::write(const void* data, uint32_t sz)
+{
+	dev.receive(data, sz, clock->now());
+	return true;
+}
+
+int SimTransport::read(void* buf, uint32_t sz, uint32_t timeout_ms)
+{
+	steady_clock::time_point t_end = steady_clock::time_point::max();
+	if (timeout_ms) t_end = clock->now() + milliseconds(timeout_ms);
+	
+	uint8_t* p = (uint8_t*) buf; uint32_t cnt = 0;
+	while (true) {
+		steady_clock::time_point t = clock->now();
+		dev.advance(t);
+		
+		vector<uint8_t>& out = dev.output();
+		uint32_t l = out.size() - pos_out;
+		if (l > sz - cnt) l = sz - cnt;
+		memcpy(p + cnt, out.data() + pos_out, l);
+		cnt += l; pos_out += l;
+		if (pos_out == out.size() || pos_out >= 65536) {
+			out.erase(out.begin(), out.begin() + pos_out); pos_out = 0;
+		}
+		if (cnt == sz || t >= t_end) break;
+		
+		// sleep until the device sends something
+		steady_clock::time_point t_wake = dev.next_event();
+		if (t_wake > t_end) t_wake = t_end;
+		if (t_wake <= t) t_wake = t + microseconds(1);
+		clock->sleep_until(t_wake);
+	}
+	return cnt;
+}
+
+int SimTransport::available()
+{
+	dev.advance(clock->now());
+	return dev.output().size() - pos_out;
+}
+
+void SimTransport::flush_receiver()
+{
+	dev.advance(clock->now());
+	dev.output().clear(); pos_out = 0;
+}
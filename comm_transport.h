@@ -0,0 +1,132 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef COMM_TRANSPORT_H
+#define COMM_TRANSPORT_H
+
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "serialib/serialib.h"
+#include "comm_protocol.h"
+#include "clock_source.h"
+#include "emu_device.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// byte stream between CommLayer and the MCU. CommTransport::create() chooses the implementation
+// by environment variables, so the pipeline can be profiled without the hardware:
+//   USB_CHARGE_CAPTURE=<file>  the serial port is used, and all bytes are recorded into the file;
+//   USB_CHARGE_REPLAY=<file>   received bytes are played back from the file, commands are answered
+//                              immediately (Resp_Check is taken from the file), and responses in the
+//                              file are left to be skipped. USB_CHARGE_REPLAY_SPEED=max plays it
+//                              without delays.
+// SimTransport is not chosen by environment variables, it is given to CommLayer by the simulation.
+class CommTransport
+{
+public:
+	static CommTransport* create();
+	virtual ~CommTransport() {}
+	
+	virtual bool is_replay() const {return false;} //real ports are not needed
+	
+	virtual bool open(const string& port_name) = 0;
+	virtual void close() = 0;
+	virtual bool write(const void* data, uint32_t sz) = 0;
+	
+	// blocks until sz bytes are read or timeout, returns count of bytes read or -1 on error.
+	virtual int read(void* buf, uint32_t sz, uint32_t timeout_ms) = 0;
+	virtual int available() = 0; //count of bytes which can be read without waiting
+	virtual void flush_receiver() = 0;
+};
+
+class SerialTransport: public CommTransport
+{
+	Serialib::Serial serial;
+
+public:
+	bool open(const string& port_name) override;
+	void close() override;
+	bool write(const void* data, uint32_t sz) override;
+	int read(void* buf, uint32_t sz, uint32_t timeout_ms) override;
+	int available() override;
+	void flush_receiver() override;
+};
+
+// capture file: 8-byte magic, then records of {uint32 time offset (us) from the previous
+// record, uint8 direction, uint16 length} followed by the bytes.
+enum {
+	Capture_Dir_Received = 0,
+	Capture_Dir_Sent = 1
+};
+extern const char Capture_Magic[8];
+
+class CaptureTransport: public SerialTransport
+{
+	string file_path; ofstream ofs;
+	steady_clock::time_point t_last;
+	
+	void record(uint8_t dir, const void* data, uint32_t sz);
+
+public:
+	CaptureTransport(const string& path);
+	bool open(const string& port_name) override;
+	void close() override;
+	bool write(const void* data, uint32_t sz) override;
+	int read(void* buf, uint32_t sz, uint32_t timeout_ms) override;
+};
+
+class ReplayTransport: public CommTransport
+{
+	struct Chunk {uint64_t t_us; uint32_t pos, len;};
+	
+	string file_path; bool max_speed, flag_played = false;
+	vector<uint8_t> data; vector<Chunk> chunks; //received bytes only
+	unsigned int i_chunk = 0; uint32_t pos_chunk = 0;
+	vector<uint8_t> resp_check, resp_pending; //responses are read before the recorded bytes
+	vector<Cmd_ADC_Config> adc_configs; //sent while recording
+	steady_clock::time_point t_start;
+	
+	bool load();
+	void load_sent(const uint8_t* p, uint32_t sz);
+	bool recorded_adc_config(const Cmd_ADC_Config* cmd) const;
+	bool is_due(const Chunk& chunk) const;
+	void answer(const CommCmd* cmd);
+
+public:
+	ReplayTransport(const string& path, bool max_speed);
+	bool is_replay() const override {return true;}
+	
+	bool open(const string& port_name) override;
+	void close() override;
+	bool write(const void* data, uint32_t sz) override;
+	int read(void* buf, uint32_t sz, uint32_t timeout_ms) override;
+	int available() override;
+	void flush_receiver() override;
+};
+
+// an emulated device in the process, driven by the clock. with a VirtualClock, the whole
+// control stack runs as fast as it can compute.
+class SimTransport: public CommTransport
+{
+	ClockSource* clock; EmuDevice dev;
+	uint32_t pos_out = 0; //bytes before it in the output of dev are read
+
+public:
+	SimTransport(ClockSource* clock, const EmuConfig& conf, unsigned int seed = 1);
+	bool is_replay() const override {return true;}
+	const EmuDevice& device() const {return dev;} //only safe to read while disconnected
+	
+	bool open(const string& port_name) override;
+	void close() override;
+	bool write(const void* data, uint32_t sz) override;
+	int read(void* buf, uint32_t sz, uint32_t timeout_ms) override;
+	int available() override;
+	void flush_receiver() override;
+};
+
+#endif
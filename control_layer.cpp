@@ -4,20 +4,28 @@
 #include "control_layer.h"
 
 using namespace std::this_thread;
-using namespace SimpleCairoPlot; //Range, CircularBuffer
+using namespace SimpleCairoPlot; //Range
 
-ChargeControlLayer::ChargeControlLayer():
-	buf_bat_voltage(20), buf_bat_current(30)
+ChargeControlLayer::ChargeControlLayer(ClockSource* clock, CommTransport* transport):
+	clk(clock? clock : ClockSource::system()), comm(clk, transport)
 {
 	data_callback_ptr =
 		MemberFuncDataCallbackPtr<ChargeControlLayer, &ChargeControlLayer::data_callback>(this);
+	comm.set_trip_limits(trip_limits());
+	comm.set_chunk_callback(
+		MemberFuncChunkCallbackPtr<ChargeControlLayer, &ChargeControlLayer::chunk_callback>(this));
+	clk->add_thread();
 	thread_control = new thread(&ChargeControlLayer::control_loop, this);
 }
 
 ChargeControlLayer::~ChargeControlLayer()
 {
-	flag_close = true;
-	thread_control->join();
+	{
+		lock_guard<mutex> lock(mtx_data);
+		flag_close = true;
+	}
+	clk->notify_all(cv_data); hotplug.interrupt();
+	clk->join(*thread_control);
 	delete thread_control;
 }
 
@@ -38,6 +46,7 @@ bool ChargeControlLayer::set_hard_config(ChargeControlConfig new_conf)
 	
 	conf = new_conf;
 	comm.set_voltage_vrefint(conf.v_refint);
+	comm.set_trip_limits(trip_limits());
 	return true;
 }
 
@@ -106,7 +115,8 @@ void ChargeControlLayer::control_loop()
 {
 	while (true) {
 		if (flag_close) {
-			if (comm.is_connected()) comm.disconnect(); return;
+			if (comm.is_connected()) comm.disconnect();
+			clk->remove_thread(); return;
 		}
 		
 		if (!check_comm() || !check_shake()) continue;
@@ -114,14 +124,39 @@ void ChargeControlLayer::control_loop()
 		wait_for_new_data(); //wait for new data callback
 		if (! check_bat_connection()) continue;
 		update_status_values();
+		bool tripped = comm.take_trip(); //the output is already disabled by CommLayer
+		
+		// short bulks for the DAC scan, long bulks when the charging current is stable.
+		// it's kept during the internal resistance measuring, as the changing drops a bulk.
+		bool steady = status.control_state == Battery_Charging_CC
+		           && flag_scrolling_average && buf_bat_voltage.is_full();
+		if (ir_phase == IR_Idle)
+			comm.set_bulk_mode((status.control_state == DAC_Scanning)? Bulk_Short
+			                 : steady? Bulk_Long : Bulk_Default);
 		
 		if (flag_start) {
 			flag_start = false;
 			status.set_state(Battery_Charging_CC);
 			status.bat_voltage_max = status.bat_voltage_initial = status.bat_voltage;
-			status.t_charge_start = status.t_bat_voltage_max = steady_clock::now();
+			status.t_charge_start = status.t_bat_voltage_max = clk->now();
 			bat_voltage_cur_max = status.bat_voltage;
 			disable_scrolling_average(); //for the adjustment at first
+			regulator = (param.regulator == Regulator_PI)? (CurrentRegulator*) &reg_pi : &reg_step;
+			regulator->reset(); t_current_in_band = steady_clock::time_point();
+			ir_phase = IR_Idle; t_ir_attempt = steady_clock::time_point();
+			
+			// feed-forward from the table. the next data may be converted partly
+			// before the output, so it is skipped.
+			float v_ff;
+			{
+				lock_guard<mutex> lock(mtx_data);
+				v_ff = dac_table.dac_voltage_for(serial_number, param.exp_current);
+			}
+			v_ff = Range(0, comm.voltage_vdda()).fit_value(v_ff);
+			if (v_ff > 0 && dac_output(v_ff)) {
+				dbg_print("feed-forward DAC voltage: " + to_string(v_ff));
+				wait_for_new_data();
+			}
 		}
 		else if (flag_stop) {
 			do_stop_charging(true); flag_stop = false;
@@ -131,7 +166,14 @@ void ChargeControlLayer::control_loop()
 		else if (flag_dac_scan) {
 			flag_dac_scan = false;
 			status.set_state(DAC_Scanning);
-			dac_output(0); disable_scrolling_average();
+			disable_scrolling_average();
+			float v_dac;
+			{
+				lock_guard<mutex> lock(mtx_data);
+				scanner.start(comm.voltage_vdda(), conf.v_dac_adj_step, conf.i_max);
+				scanner.next(&v_dac);
+			}
+			dac_output(v_dac); cnt_scan_wait = 1;
 		}
 		else if (flag_stop_dac_scan) {
 			flag_stop_dac_scan = false;
@@ -141,36 +183,52 @@ void ChargeControlLayer::control_loop()
 		}
 		
 		else if (status.control_state == DAC_Scanning) {
-			if (status.dac_voltage >= comm.voltage_vdda()) {
+			if (!tripped && cnt_scan_wait > 0) {
+				cnt_scan_wait--; continue;
+			}
+			
+			float v_dac; bool done;
+			{
+				lock_guard<mutex> lock(mtx_data);
+				if (tripped) scanner.add_limit();
+				else scanner.add(status.bat_current, status.bat_voltage);
+				done = ! scanner.next(&v_dac);
+				if (done) dac_table.set_curve(serial_number, scanner.curve());
+			}
+			if (done) {
 				dac_output(0); enable_scrolling_average();
 				status.set_state(Battery_Connected);
 				event_callback_ptr.call(Event_Scan_Complete); continue;
 			}
-			status.dac_voltage += conf.v_dac_adj_step;
-			comm.dac_output(status.dac_voltage);
+			dac_output(v_dac); cnt_scan_wait = 1;
 		}
 		
 		else if (status.is_charging()) {
 			// check for emergency stop
-			if (status.bat_current > 1.1 * conf.i_max || status.mos_power > 1.1 * conf.p_mos_max) {
+			if (tripped
+			||  status.bat_current > 1.1 * conf.i_max || status.mos_power > 1.1 * conf.p_mos_max) {
 				stop_charging(StopFlag_Brake); continue;
 			}
 			
-			// internal resistance (DC) measuring
-			if (!status.flag_ir_measured && ms_since(status.t_charge_start) >=  30 * 1000
-			||   status.flag_ir_measured && ms_since(status.t_ir_measure)   >= 300 * 1000)
-				measure_ir();
-			
 			// check for expected charge
 			if (status.bat_charge >= param.exp_charge) {
 				stop_charging(StopFlag_Exp_Charge); continue;
 			}
 			
 			// check for time limit
-			if (ms_since(status.t_charge_start) >= param.time_limit_sec * 1000) {
+			if (clk->ms_since(status.t_charge_start) >= param.time_limit_sec * 1000) {
 				stop_charging(StopFlag_Time_Limit); continue;
 			}
 			
+			// internal resistance (DC) measuring, the current isn't adjusted until it's finished
+			if (ir_phase != IR_Idle) {
+				check_ir_measure(); continue;
+			}
+			if ((!status.flag_ir_measured && clk->ms_since(status.t_charge_start) >=  30 * 1000
+			||    status.flag_ir_measured && clk->ms_since(status.t_ir_measure)   >= 300 * 1000)
+			&&  clk->ms_since(t_ir_attempt) >= IR_Retry_Interval && start_ir_measure())
+				continue;
+			
 			// new DAC voltage to be determined
 			float dac_voltage = status.dac_voltage;
 			float cnt_steps = 0;
@@ -207,9 +265,12 @@ void ChargeControlLayer::control_loop()
 				}
 				
 				// current adjustment
-				float diff_current = status.bat_current - param.exp_current;
-				if (! p_mos_reached_max)
-					cnt_steps = -diff_current / 0.003;
+				if (status.t_settling < 0) update_settling();
+				if (! p_mos_reached_max) {
+					RegulatorInput in = {status.bat_current, bat_current_raw, param.exp_current,
+					                     dac_voltage, conf.v_dac_adj_step, conf.r_samp};
+					dac_voltage = regulator->regulate(in);
+				}
 			}
 			
 			// const voltage stage
@@ -233,7 +294,7 @@ void ChargeControlLayer::control_loop()
 			
 			// set scrolling average mode
 			if (! Range(-0.01, 0.01).contain(dac_voltage - status.dac_voltage)
-			||  buf_bat_current.get_value_range().length() >= 0.005)
+			||  buf_bat_current.get_stddev() >= Current_Stddev_Stable)
 				disable_scrolling_average();
 			else {
 				if (! flag_scrolling_average) {
@@ -247,7 +308,7 @@ void ChargeControlLayer::control_loop()
 		
 		else {
 			dac_output(0);
-			this_thread::sleep_for(milliseconds(400)); //idle
+			clk->sleep_for(milliseconds(400)); //idle
 		}
 	}
 }
@@ -260,16 +321,42 @@ bool ChargeControlLayer::check_comm()
 		// disconnect event
 		do_stop_charging(false); status.control_state = Device_Disconnected;
 		event_callback_ptr.call(Event_Device_Disconnect);
+		t_full_scan = steady_clock::time_point(); //the device may still be there
 	}
 	
-	this_thread::sleep_for(milliseconds(500));
-	if (! comm.connect(data_callback_ptr)) return false;
+	bool use_hotplug = hotplug.is_available() && comm.uses_real_ports();
+	unsigned long scan_interval = use_hotplug? Full_Scan_Interval : 500;
+	unsigned long ms = clk->ms_since(t_full_scan);
+	bool connected = false;
+	if (ms >= scan_interval) {
+		connected = comm.connect(data_callback_ptr);
+		t_full_scan = clk->now();
+	} else if (use_hotplug) {
+		// the new ports are probed concurrently, the first responsive one is opened
+		vector<string> port_names;
+		if (hotplug.wait(scan_interval - ms, &port_names)) {
+			vector<char> responsive = CommLayer::probe_ports(port_names);
+			for (unsigned int i = 0; i < port_names.size() && !connected; i++)
+				if (responsive[i]) connected = comm.connect(data_callback_ptr, port_names[i]);
+		}
+	} else
+		clk->sleep_for(milliseconds(scan_interval - ms));
+	if (! connected) return false;
 	
 	if (! conf.v_refint) conf.v_refint = comm.voltage_vrefint();
+	{
+		lock_guard<mutex> lock(mtx_data);
+		serial_number = comm.serial_number();
+		dac_table.prepare(serial_number);
+	}
 	
 	// connect event
 	dac_output(0);
 	status.reset(); cnt_shake_failed = 0;
+	{
+		lock_guard<mutex> lock(mtx_data);
+		flag_shake_pending = flag_shake_done = false;
+	}
 	status.control_state = Battery_Disconnected;
 	wait_for_new_data();
 	if (! check_bat_connection()) //otherwise Event_Battery_Connect will be raised
@@ -278,41 +365,86 @@ bool ChargeControlLayer::check_comm()
 	return true;
 }
 
+// doesn't wait for the response of the shake command. returns false if the device is disconnected.
 bool ChargeControlLayer::check_shake()
 {
 	if (! comm.is_connected()) return false;
-	if (ms_since(t_shake_suc) < Shake_Interval_Max / 2.0) return true;
-	if (ms_since(t_shake) < 150) return false; //avoid short interval
 	
-	// send handshake command, otherwise the mcu will stop charging
-	bool shake_suc = comm.shake(); t_shake = steady_clock::now();
-	
-	if (shake_suc) {
-		cnt_shake_failed = 0; t_shake_suc = steady_clock::now();
-	} else {
-		if (++cnt_shake_failed > 5) {
+	bool pending, done, suc;
+	{
+		lock_guard<mutex> lock(mtx_data);
+		pending = flag_shake_pending; done = flag_shake_done; suc = flag_shake_suc;
+		flag_shake_done = false;
+	}
+	if (done) {
+		if (suc)
+			cnt_shake_failed = 0;
+		else if (++cnt_shake_failed > 5) {
 			// disconnect event
 			do_stop_charging(false); status.control_state = Device_Disconnected;
 			comm.disconnect();
 			event_callback_ptr.call(Event_Device_Disconnect);
+			return false;
 		}
 	}
 	
-	return shake_suc;
+	if (clk->ms_since(comm.keep_alive_time()) < Shake_Interval_Max / 2.0) {
+		cnt_shake_failed = 0; return true;
+	}
+	if (pending) return true;
+	if (clk->ms_since(t_shake) < 150) return true; //avoid short interval
+	
+	// send handshake command, otherwise the mcu will stop charging
+	{
+		lock_guard<mutex> lock(mtx_data);
+		flag_shake_pending = true;
+	}
+	t_shake = clk->now();
+	comm.shake(MemberFuncCmdCallbackPtr<ChargeControlLayer, &ChargeControlLayer::shake_callback>(this));
+	return true;
 }
 
+// called by CommLayer, it wakes up wait_for_new_data() for check_shake()
+void ChargeControlLayer::shake_callback(uint8_t cmd_id, bool suc)
+{
+	{
+		lock_guard<mutex> lock(mtx_data);
+		flag_shake_pending = false; flag_shake_done = true; flag_shake_suc = suc;
+	}
+	clk->notify_one(cv_data);
+}
+
+// the time before which check_shake() has nothing to do. mtx_data is locked.
+steady_clock::time_point ChargeControlLayer::shake_deadline() const
+{
+	if (flag_shake_pending) return steady_clock::time_point::max(); //shake_callback() wakes it up
+	steady_clock::time_point t = comm.keep_alive_time() + milliseconds(Shake_Interval_Max / 2);
+	if (t > clk->now()) return t;
+	return t_shake + milliseconds(150);
+}
+
+// blocks until data_callback() is called, wakes up for check_shake() in time.
 bool ChargeControlLayer::wait_for_new_data()
 {
+	unique_lock<mutex> lock(mtx_data);
 	flag_new_data = false;
 	while (comm.is_connected() && !flag_new_data && !flag_close) {
-		check_shake();
-		this_thread::sleep_for(milliseconds(10));
+		lock.unlock(); check_shake(); lock.lock();
+		if (flag_new_data || flag_close) break;
+		if (flag_shake_done) continue;
+		
+		// CommLayer doesn't notify on disconnection, so it is checked at least in this interval
+		steady_clock::time_point t_wake = clk->now() + milliseconds(Timeout_Comm_Max),
+		                         t_shake_next = shake_deadline();
+		if (t_shake_next < t_wake) t_wake = t_shake_next;
+		clk->wait_until(cv_data, lock, t_wake);
 	}
 	
 	if (flag_new_data) {
 		bat_current_raw = usamp / conf.r_samp;
 		bat_voltage_raw = conf.v_ext_power - udiv / conf.div_prop
 		                - status.bat_current * conf.r_extra;
+		t_data_used = t_new_data;
 	}
 	return flag_new_data;
 }
@@ -354,8 +486,8 @@ bool ChargeControlLayer::check_bat_connection()
 
 void ChargeControlLayer::update_status_values()
 {
-	if (status.is_charging()) {
-		float dur_sec = ms_since(status.t_last_update) / 1000.0;
+	if (status.is_charging() && status.t_last_update != steady_clock::time_point()) {
+		float dur_sec = clk->ms_since(status.t_last_update) / 1000.0;
 		status.bat_charge += status.bat_current * dur_sec;
 		status.bat_energy += (status.bat_power - status.bat_current * status.ir) * dur_sec;
 	}
@@ -381,55 +513,133 @@ void ChargeControlLayer::update_status_values()
 	if (status.is_charging()) {
 		if (status.bat_voltage > status.bat_voltage_max) {
 			status.bat_voltage_max = status.bat_voltage;
-			status.t_bat_voltage_max = steady_clock::now();
+			status.t_bat_voltage_max = clk->now();
 		}
 		if (status.bat_current > status.bat_current_max) {
 			status.bat_current_max = status.bat_current;
-			status.t_bat_current_max = steady_clock::now();
+			status.t_bat_current_max = clk->now();
 		}
 	}
 	
-	status.t_last_update = steady_clock::now();
+	status.t_last_update = clk->now();
 	event_callback_ptr.call(Event_New_Data);
 }
 
-bool ChargeControlLayer::measure_ir()
+// the current is settled when it has been kept in the band (2% of the expected current, or 3 mA
+// for small currents) for Settle_Hold_Time. the overshoot is taken until then.
+void ChargeControlLayer::update_settling()
 {
-	if (! status.is_charging() || status.bat_current < 0.01) return false;
-	
-	disable_scrolling_average();
+	float diff_current = bat_current_raw - param.exp_current;
+	if (diff_current > status.i_overshoot) status.i_overshoot = diff_current;
+	
+	steady_clock::time_point t_init;
+	float band = (param.exp_current > 0.15)? 0.02 * param.exp_current : 0.003;
+	if (fabs(diff_current) > band)
+		t_current_in_band = t_init;
+	else if (t_current_in_band == t_init)
+		t_current_in_band = clk->now();
+	else if (clk->ms_since(t_current_in_band) >= Settle_Hold_Time) {
+		status.t_settling = duration_cast<milliseconds>(t_current_in_band - status.t_charge_start).count()
+		                  / 1000.0;
+		dbg_print("current settled in " + to_string(status.t_settling) + " s");
+		lock_guard<mutex> lock(mtx_data);
+		dac_table.learn(serial_number, status.dac_voltage, status.bat_current);
+	}
+}
+
+// the output is disabled for the pulse, it's restored by check_ir_measure()
+bool ChargeControlLayer::start_ir_measure()
+{
+	t_ir_attempt = clk->now();
+	if (bat_current_raw < 0.01) return false;
 	
-	float bat_voltage_prev = status.bat_voltage,
-	      bat_current_prev = status.bat_current;
-	steady_clock::time_point t = steady_clock::now();
+	ir_dac_voltage = status.dac_voltage; ir_current = bat_current_raw;
+	{
+		lock_guard<mutex> lock(mtx_data);
+		ir_seq_pulse = cnt_ir_chunks? ir_chunks[(ir_chunk_pos + IR_Chunks_Max - 1) % IR_Chunks_Max].seq : 0;
+	}
+	if (! comm.dac_output(0)) return false;
+	comm.set_bulk_mode(Bulk_Short); //applied with the output
 	
-	bool suc = true;
-	while (status.bat_current > bat_current_prev / 5.0 + 0.002) {
-		check_shake(); comm.dac_output(0);
-		if (!wait_for_new_data() || ms_since(t) > 3000) {
-			dbg_print("measure_ir failed");
-			suc = false; break;
+	disable_scrolling_average();
+	ir_phase = IR_Pulse; t_ir_pulse = clk->now(); cnt_ir_recovered = 0;
+	return true;
+}
+
+// called for each new data while it is measuring
+void ChargeControlLayer::check_ir_measure()
+{
+	if (ir_phase == IR_Pulse) {
+		int result = ir_pulse_result();
+		if (result == 0) return;
+		if (result < 0) {
+			dbg_print("internal resistance measuring failed");
 		}
-		update_status_values();
+		comm.dac_output(ir_dac_voltage);
+		ir_phase = IR_Recover;
+		return;
 	}
 	
-	if (suc) {
-		status.ir =   (bat_voltage_prev - status.bat_voltage)
-		            / (bat_current_prev - status.bat_current);
-		status.flag_ir_measured = true;
-		status.t_ir_measure = steady_clock::now();
+	// the current should be restored in two data, as the voltage is compensated (for r_extra)
+	// by the current of the previous data
+	if (clk->ms_since(t_ir_pulse) < 3000) {
+		if (cnt_ir_recovered == 0 && bat_current_raw < 0.9 * ir_current) return;
+		if (++cnt_ir_recovered == 1) {
+			status.t_ir_lost += clk->ms_since(t_ir_pulse) / 1000.0; return;
+		}
+	} else
+		status.t_ir_lost += clk->ms_since(t_ir_pulse) / 1000.0;
+	enable_scrolling_average();
+	ir_phase = IR_Idle;
+}
+
+// returns 1 if it is measured, 0 if the falling edge is not received yet, -1 if it failed.
+// two chunks are averaged on each side of the edge, one chunk in the edge can be skipped.
+int ChargeControlLayer::ir_pulse_result()
+{
+	const int Chunks_Side = 2;
+	float v[IR_Chunks_Max], i[IR_Chunks_Max]; uint64_t seq[IR_Chunks_Max];
+	int cnt = 0;
+	{
+		lock_guard<mutex> lock(mtx_data);
+		for (unsigned int k = 0; k < cnt_ir_chunks; k++) { //from the oldest
+			const ChunkValues& c = ir_chunks[(ir_chunk_pos + IR_Chunks_Max - cnt_ir_chunks + k) % IR_Chunks_Max];
+			i[cnt] = c.u2 / conf.r_samp;
+			v[cnt] = conf.v_ext_power - c.u1 / conf.div_prop - i[cnt] * conf.r_extra;
+			seq[cnt++] = c.seq;
+		}
 	}
 	
-	t = steady_clock::now();
-	while (status.bat_voltage < 0.99 * bat_voltage_prev) {
-		check_shake(); comm.dac_output(status.dac_voltage);
-		if (!wait_for_new_data() || ms_since(t) > 10000) break;
-		update_status_values();
+	// checks Chunks_Side chunks from k
+	float i_low = ir_current / 5.0 + 0.002, i_high = 0.9 * ir_current;
+	auto is_side = [&](int k, bool low) {
+		for (int j = k; j < k + Chunks_Side; j++)
+			if ((low? i[j] > i_low : i[j] < i_high) || (j > k && seq[j] != seq[j - 1] + 1)) return false;
+		return true;
+	};
+	
+	for (int l = 0; l + Chunks_Side <= cnt; l++) {
+		if (seq[l] <= ir_seq_pulse || ! is_side(l, true)) continue;
+		
+		for (int e = l - 1; e >= l - 2 && e >= Chunks_Side - 1; e--) { //the end of the current
+			int h = e - Chunks_Side + 1;
+			if (seq[l] - seq[e] > 2 || ! is_side(h, false)) continue;
+			
+			float v_high = 0, i_high_av = 0, v_low = 0, i_low_av = 0;
+			for (int j = 0; j < Chunks_Side; j++) {
+				v_high += v[h + j]; i_high_av += i[h + j];
+				v_low += v[l + j]; i_low_av += i[l + j];
+			}
+			status.ir = (v_high - v_low) / (i_high_av - i_low_av);
+			status.flag_ir_measured = true; status.t_ir_measure = clk->now();
+			status.cnt_ir_measure++;
+			dbg_print("internal resistance: " + to_string(status.ir));
+			return 1;
+		}
+		return -1; //the edge is found without the current before it
 	}
 	
-	wait_for_new_data(); wait_for_new_data();
-	enable_scrolling_average();
-	return true;
+	return (clk->ms_since(t_ir_pulse) > 3000)? -1 : 0;
 }
 
 void ChargeControlLayer::stop_charging(ChargeStopFlag flag)
@@ -453,11 +663,14 @@ void ChargeControlLayer::do_stop_charging(bool remeasure_voltage)
 		dac_output(0);
 	
 	status.control_state = Charge_Stopped;
-	status.t_charge_stop = steady_clock::now();
+	status.t_charge_stop = clk->now();
+	if (ir_phase != IR_Idle && cnt_ir_recovered == 0)
+		status.t_ir_lost += clk->ms_since(t_ir_pulse) / 1000.0;
+	ir_phase = IR_Idle;
 	
 	if (comm.is_connected() && remeasure_voltage) {
 		disable_scrolling_average();
-		this_thread::sleep_for(milliseconds(1000));
+		clk->sleep_for(milliseconds(1000));
 		wait_for_new_data();
 	}
 	status.bat_voltage_final = status.bat_voltage;
@@ -467,6 +680,21 @@ void ChargeControlLayer::do_stop_charging(bool remeasure_voltage)
 // in CommLayer's data processing thread
 void ChargeControlLayer::data_callback(float udiv, float usamp)
 {
-	this->udiv = udiv; this->usamp = usamp;
-	flag_new_data = true; return;
+	{
+		lock_guard<mutex> lock(mtx_data);
+		this->udiv = udiv; this->usamp = usamp;
+		flag_new_data = true; t_new_data = clk->now();
+	}
+	clk->notify_one(cv_data);
+}
+
+// in CommLayer's data processing thread, before data_callback() of the same bulk
+void ChargeControlLayer::chunk_callback(const DataChunk& chunk)
+{
+	if (chunk.u1 == 0) return; //invalid
+	lock_guard<mutex> lock(mtx_data);
+	ChunkValues& c = ir_chunks[ir_chunk_pos];
+	c.seq = chunk.seq; c.u1 = chunk.u1; c.u2 = chunk.u2;
+	ir_chunk_pos = (ir_chunk_pos + 1) % IR_Chunks_Max;
+	if (cnt_ir_chunks < IR_Chunks_Max) cnt_ir_chunks++;
 }
@@ -5,6 +5,10 @@
 #define CONTROL_LAYER_H
 
 #include "comm_layer.h"
+#include "current_regulator.h"
+#include "dac_scanner.h"
+#include "dac_table.h"
+#include "hotplug.h"
 
 #ifdef dbg_print
 	#undef dbg_print
@@ -18,6 +22,7 @@
 
 using namespace std::chrono;
 
+// in real time. ChargeControlLayer measures time by its ClockSource instead.
 inline unsigned long int ms_since(steady_clock::time_point t) {
 	return duration_cast<milliseconds>(steady_clock::now() - t).count();
 }
@@ -112,6 +117,7 @@ struct ChargeParameters
 	float min_current = 0.05;
 	
 	unsigned int time_limit_sec = 3600;
+	ChargeRegulator regulator = Regulator_Step; //for the const current stage
 };
 
 struct ChargeStatus
@@ -132,6 +138,11 @@ struct ChargeStatus
 	
 	bool flag_ir_measured = false; steady_clock::time_point t_ir_measure;
 	float ir = 0; //DC internal resistance estimation (ohm)
+	unsigned int cnt_ir_measure; float t_ir_lost; //seconds without the charging current for it
+	
+	// the current after the charge start: seconds until it stays near the expected current
+	// (negative if it hasn't), and the maximum excess over the expected current until then (A).
+	float t_settling, i_overshoot;
 	
 	float bat_charge, bat_energy; //unit: C, J
 	
@@ -164,6 +175,8 @@ inline void ChargeStatus::set_state(ChargeControlState st)
 	bat_voltage_initial = bat_voltage_final = 0;
 	bat_voltage_max = bat_current_max = 0;
 	flag_ir_measured = false; ir = 0;
+	cnt_ir_measure = 0; t_ir_lost = 0;
+	t_settling = -1; i_overshoot = 0;
 	bat_charge = bat_energy = 0;
 	
 	steady_clock::time_point t_init;
@@ -216,7 +229,8 @@ inline EventCallbackPtr MemberFuncEventCallbackPtr(T* pobj)
 class ChargeControlLayer
 {
 public:
-	ChargeControlLayer();
+	// the system clock and CommTransport::create() are used by default.
+	ChargeControlLayer(ClockSource* clock = NULL, CommTransport* transport = NULL);
 	~ChargeControlLayer();
 	
 	float data_interval() const;
@@ -224,10 +238,16 @@ public:
 	ChargeParameters charge_param() const;
 	ChargeStatus control_status() const;
 	const ChargeStatus* control_status_ptr() const;
+	CommStatistics comm_statistics() const;
+	LatencyHistogram decision_latency() const; //from the arrival of data to the DAC output based on it
+	vector<DacScanPoint> dac_scan_curve() const; //measured points of the last DAC scan
+	DacCurrentTable dac_current_table() const;
 	
 	bool set_hard_config(ChargeControlConfig new_conf);
 	bool set_charge_param(ChargeParameters new_param);
 	void set_event_callback_ptr(EventCallbackPtr ptr);
+	void set_dac_current_table(const DacCurrentTable& table); //loaded from the file
+	void set_data_format(uint8_t format); //see CommLayer::set_data_format()
 	void calibrate(float v_bat_actual);
 	bool dac_scan();
 	void stop_dac_scan();
@@ -240,41 +260,93 @@ private:
 	ChargeStatus status;
 	EventCallbackPtr event_callback_ptr;
 	
+	ClockSource* clk;
 	CommLayer comm; DataCallbackPtr data_callback_ptr;
 	thread* thread_control = NULL;
 	
+	// all ports are scanned at first, after a disconnection and in this interval;
+	// otherwise only new ports reported by the hotplug monitor are probed.
+	enum {Full_Scan_Interval = 60 * 1000};
+	HotplugMonitor hotplug; steady_clock::time_point t_full_scan;
+	
 	// set by data callback from CommLayer
-	volatile bool flag_new_data = false;
-	volatile float udiv = 0, usamp = 0;
+	bool flag_new_data = false;
+	float udiv = 0, usamp = 0;
+	steady_clock::time_point t_new_data, t_data_used;
+	mutable mutex mtx_data; condition_variable cv_data;
+	LatencyHistogram hist_decision_latency;
 	
 	// set by external functions
 	volatile bool flag_dac_scan = false, flag_stop_dac_scan = false;
 	volatile bool flag_start = false, flag_stop = false, flag_close = false;
 	
-	steady_clock::time_point t_shake, t_shake_suc;
+	// the shake command is sent only when no keep-alive command has succeeded for a while.
+	// the result is set by shake_callback() under mtx_data.
+	steady_clock::time_point t_shake;
+	bool flag_shake_pending = false, flag_shake_done = false, flag_shake_suc = false;
 	unsigned int cnt_shake_failed = 0;
 	
 	float bat_voltage_raw = 0, bat_current_raw = 0;
 	
+	// the internal resistance is measured by a pulse of zero current without blocking control_loop().
+	// the voltage and current before and after the falling edge are taken from the chunks of
+	// the bulks, which are kept by chunk_callback() under mtx_data.
+	enum IRPhase {IR_Idle = 0, IR_Pulse, IR_Recover};
+	IRPhase ir_phase = IR_Idle;
+	float ir_dac_voltage = 0, ir_current = 0; //before the pulse
+	unsigned int cnt_ir_recovered = 0;
+	steady_clock::time_point t_ir_pulse, t_ir_attempt;
+	
+	enum {IR_Chunks_Max = 64, IR_Retry_Interval = 5 * 1000};
+	struct ChunkValues {uint64_t seq; float u1, u2;};
+	ChunkValues ir_chunks[IR_Chunks_Max]; //circular
+	unsigned int ir_chunk_pos = 0, cnt_ir_chunks = 0;
+	uint64_t ir_seq_pulse = 0; //the last chunk before the pulse is requested
+	
 	bool flag_scrolling_average = false; //status values are averaged when it's set 
-	CircularBuffer buf_bat_voltage, buf_bat_current;
+	WindowedStats<float, 20> buf_bat_voltage; WindowedStats<float, 30> buf_bat_current;
+	
+	// scrolling average is disabled when the current is not stable. 1.25 mA is about the
+	// quarter of the range of 30 values with a normal distribution of 5 mA range.
+	static constexpr float Current_Stddev_Stable = 0.00125; //A
 	
 	// used for voltage decline check. when flag_scrolling_average is true,
 	// it is the recent maximum value under stable current condition.
 	float bat_voltage_cur_max = 0;
 	
+	// the voltage given by the scanner is measured by the second data after the output,
+	// as the first one may be converted partly with the previous output.
+	// the curve is modified under mtx_data.
+	DacScanner scanner; unsigned int cnt_scan_wait = 0;
+	
+	// gives the DAC voltage at the charge start, updated by the scan and when the current
+	// is settled. both are modified under mtx_data.
+	DacCurrentTable dac_table; string serial_number; //of the connected device
+	
+	// chosen by ChargeParameters::regulator at the charge start
+	StepRegulator reg_step; PIRegulator reg_pi;
+	CurrentRegulator* regulator = &reg_step;
+	enum {Settle_Hold_Time = 10 * 1000}; //ms
+	steady_clock::time_point t_current_in_band; //for ChargeStatus::t_settling
+	
 	void control_loop();
 	
 	bool check_comm();
 	bool check_shake();
+	void shake_callback(uint8_t cmd_id, bool suc);
+	steady_clock::time_point shake_deadline() const;
 	
 	bool wait_for_new_data();
 	bool check_bat_connection();
 	void update_status_values();
+	void update_settling();
 	
 	bool dac_output(float val);
+	TripLimits trip_limits() const; //for the protection in CommLayer
 	
-	bool measure_ir();
+	bool start_ir_measure();
+	void check_ir_measure();
+	int ir_pulse_result();
 	void stop_charging(ChargeStopFlag flag);
 	void do_stop_charging(bool remeasure_voltage);
 	
@@ -283,6 +355,7 @@ private:
 	void restart_scrolling_average();
 	
 	void data_callback(float udiv, float usamp);
+	void chunk_callback(const DataChunk& chunk);
 };
 
 inline ChargeControlConfig ChargeControlLayer::hard_config() const
@@ -310,6 +383,40 @@ inline const ChargeStatus* ChargeControlLayer::control_status_ptr() const
 	return &status;
 }
 
+inline CommStatistics ChargeControlLayer::comm_statistics() const
+{
+	return comm.comm_statistics();
+}
+
+inline LatencyHistogram ChargeControlLayer::decision_latency() const
+{
+	lock_guard<mutex> lock(mtx_data);
+	return hist_decision_latency;
+}
+
+inline vector<DacScanPoint> ChargeControlLayer::dac_scan_curve() const
+{
+	lock_guard<mutex> lock(mtx_data);
+	return scanner.curve();
+}
+
+inline DacCurrentTable ChargeControlLayer::dac_current_table() const
+{
+	lock_guard<mutex> lock(mtx_data);
+	return dac_table;
+}
+
+inline void ChargeControlLayer::set_dac_current_table(const DacCurrentTable& table)
+{
+	lock_guard<mutex> lock(mtx_data);
+	dac_table = table; dac_table.prepare(serial_number);
+}
+
+inline void ChargeControlLayer::set_data_format(uint8_t format)
+{
+	comm.set_data_format(format);
+}
+
 inline void ChargeControlLayer::set_event_callback_ptr(EventCallbackPtr ptr)
 {
 	event_callback_ptr = ptr;
@@ -320,7 +427,7 @@ inline void ChargeControlLayer::set_event_callback_ptr(EventCallbackPtr ptr)
 inline void ChargeControlLayer::enable_scrolling_average()
 {
 	if (flag_scrolling_average) return;
-	buf_bat_current.clear(true); buf_bat_voltage.clear(true);
+	buf_bat_current.clear(); buf_bat_voltage.clear();
 	if (bat_voltage_raw) {
 		buf_bat_current.push(status.bat_current = bat_current_raw);
 		buf_bat_voltage.push(status.bat_voltage = bat_voltage_raw);
@@ -346,10 +453,26 @@ inline void ChargeControlLayer::restart_scrolling_average()
 	enable_scrolling_average();
 }
 
+// the same limits as the emergency stop in control_loop()
+inline TripLimits ChargeControlLayer::trip_limits() const
+{
+	TripLimits limits;
+	limits.r_samp = conf.r_samp; limits.div_prop = conf.div_prop;
+	limits.i_max = 1.1 * conf.i_max; limits.p_mos_max = 1.1 * conf.p_mos_max;
+	return limits;
+}
+
 inline bool ChargeControlLayer::dac_output(float val)
 {
 	bool suc = comm.dac_output(val);
 	if (suc) status.dac_voltage = val;
+	
+	steady_clock::time_point t_init;
+	if (suc && t_data_used != t_init) {
+		lock_guard<mutex> lock(mtx_data);
+		hist_decision_latency.add(clk->now() - t_data_used);
+		t_data_used = t_init; //each data is counted once
+	}
 	return suc;
 }
 
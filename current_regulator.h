@@ -0,0 +1,115 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef CURRENT_REGULATOR_H
+#define CURRENT_REGULATOR_H
+
+#include <cmath>
+
+enum ChargeRegulator
+{
+	Regulator_Step = 0, //StepRegulator
+	Regulator_PI        //PIRegulator
+};
+
+// values given to the regulator for each new data in the const current stage
+struct RegulatorInput
+{
+	float current;     //status value, averaged when the current is stable (A)
+	float current_raw; //from the latest bulk only (A)
+	float exp_current; //(A)
+	float dac_voltage; //the output being applied (V)
+	float dac_step;    //ChargeControlConfig::v_dac_adj_step (V)
+	float r_samp;      //ChargeControlConfig::r_samp (ohm)
+};
+
+// decides the DAC voltage of the const current stage. the caller keeps the result
+// in the range of the DAC, and it may apply another voltage (for the MOS power limit);
+// the applied voltage is given back in the next input.
+class CurrentRegulator
+{
+public:
+	virtual ~CurrentRegulator() {}
+	virtual void reset() = 0; //at the charge start
+	virtual float regulate(const RegulatorInput& in) = 0; //returns the new DAC voltage
+};
+
+// the original adjustment: one step for each 3 mA of the difference, at most 15 steps
+// for each data.
+class StepRegulator: public CurrentRegulator
+{
+public:
+	void reset() override {}
+	float regulate(const RegulatorInput& in) override;
+};
+
+inline float StepRegulator::regulate(const RegulatorInput& in)
+{
+	float cnt_steps = -(in.current - in.exp_current) / 0.003;
+	if (cnt_steps > 15) cnt_steps = 15;
+	if (cnt_steps < -15) cnt_steps = -15;
+	return in.dac_voltage + cnt_steps * in.dac_step;
+}
+
+// incremental PI regulator on the raw current. the gains are scaled by the inverse of
+// the DAC-to-current slope, which is measured from the changes of the output and the
+// current (it can't exceed 1 / r_samp, as the sampling resistor is in the gate loop).
+// the integral part is the applied output itself, so it doesn't wind up at the limits.
+class PIRegulator: public CurrentRegulator
+{
+	float kp, ki, dv_max;
+	float slope = 0; //dI/dV (A/V), 0 if it's not measured yet
+	float err_prev = 0, dac_prev = 0, current_prev = 0;
+	bool flag_prev = false;
+
+public:
+	// gains are the fractions of the error corrected by each data,
+	// dv_max limits the change of output for each data (V).
+	PIRegulator(float kp = 0.2, float ki = 0.5, float dv_max = 0.05);
+	
+	float dac_current_slope() const {return slope;}
+	void reset() override;
+	float regulate(const RegulatorInput& in) override;
+};
+
+inline PIRegulator::PIRegulator(float kp, float ki, float dv_max):
+	kp(kp), ki(ki), dv_max(dv_max) {}
+
+inline void PIRegulator::reset()
+{
+	slope = 0; flag_prev = false;
+}
+
+inline float PIRegulator::regulate(const RegulatorInput& in)
+{
+	const float slope_max = 1.0 / in.r_samp, slope_min = 0.1 / in.r_samp;
+	
+	// the slope is taken from changes large enough against the noise, while the current flows.
+	// the output is applied between bulks, so the latest bulk reflects the previous output.
+	if (flag_prev && in.current_raw > 0.01 && current_prev > 0.01
+	&&  fabs(in.dac_voltage - dac_prev) >= 5 * in.dac_step) {
+		float s = (in.current_raw - current_prev) / (in.dac_voltage - dac_prev);
+		if (s > slope_max) s = slope_max;
+		if (s < slope_min) s = slope_min;
+		slope = slope? (slope + s) / 2 : s;
+	}
+	
+	// the output is raised quickly to the threshold of the MOSFET. then, before the slope
+	// is measured, it is assumed to be the half of the maximum.
+	if (! slope && in.current_raw < in.exp_current / 2) {
+		err_prev = in.exp_current - in.current_raw; dac_prev = in.dac_voltage;
+		current_prev = in.current_raw; flag_prev = true;
+		return in.dac_voltage + dv_max;
+	}
+	float gain = 1.0 / (slope? slope : slope_max / 2);
+	float err = in.exp_current - in.current_raw;
+	float dv = gain * (ki * err + kp * (flag_prev? err - err_prev : 0));
+	if (dv > dv_max) dv = dv_max;
+	if (dv < -dv_max) dv = -dv_max;
+	
+	err_prev = err; dac_prev = in.dac_voltage; current_prev = in.current_raw;
+	flag_prev = true;
+	return in.dac_voltage + dv;
+}
+
+#endif
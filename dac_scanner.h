@@ -0,0 +1,146 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef DAC_SCANNER_H
+#define DAC_SCANNER_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+struct DacScanPoint
+{
+	float dac_voltage, bat_current, bat_voltage; //unit: V, A, V
+};
+
+// adaptive scan of the DAC-to-current curve. a sweep from 0 takes long steps in the cut-off
+// region and steps of about current_step in the conducting region, until the current limit
+// is reached. then each interval is bisected while its middle point differs from the linear
+// interpolation by more than tolerance. as the current rises with the DAC voltage, an interval
+// with a smaller change of current than the tolerance is never bisected.
+class DacScanner
+{
+	float step_max, step_min, current_step, tolerance;
+	float v_max, i_max;
+	
+	vector<DacScanPoint> points; //sorted by dac_voltage
+	struct Interval {float v_begin, v_end;};
+	vector<Interval> intervals; //to be bisected, the last one is the next
+	bool flag_sweep = false, flag_done = true;
+	float v_next = 0; //being measured
+	
+	void add_interval(float v_begin, float v_end);
+
+public:
+	DacScanner(float step_max = 0.1, float current_step = 0.02, float tolerance = 0.001);
+	
+	// step_min is the resolution of the DAC voltage (V)
+	void start(float v_max, float step_min, float i_max);
+	bool is_done() const {return flag_done;}
+	
+	// returns false if the scan is completed, otherwise gives the voltage to be measured
+	bool next(float* v_dac);
+	void add(float current, float voltage); //result of the voltage given by next()
+	void add_limit(); //the protection tripped at the voltage given by next()
+	
+	const vector<DacScanPoint>& curve() const {return points;}
+	float current_at(float v_dac) const; //linear interpolation
+};
+
+inline DacScanner::DacScanner(float step_max, float current_step, float tolerance):
+	step_max(step_max), current_step(current_step), tolerance(tolerance) {}
+
+inline void DacScanner::start(float v_max, float step_min, float i_max)
+{
+	this->v_max = v_max; this->step_min = step_min; this->i_max = i_max;
+	points.clear(); intervals.clear();
+	flag_sweep = true; flag_done = false;
+	v_next = 0;
+}
+
+inline bool DacScanner::next(float* v_dac)
+{
+	if (flag_done) return false;
+	if (flag_sweep) {
+		if (v_next <= v_max) {
+			*v_dac = v_next; return true;
+		}
+		flag_sweep = false;
+		for (int i = (int)points.size() - 2; i >= 0; i--) //the lowest is bisected first
+			add_interval(points[i].dac_voltage, points[i + 1].dac_voltage);
+	}
+	
+	if (intervals.empty()) {
+		flag_done = true; return false;
+	}
+	Interval& itv = intervals.back();
+	*v_dac = v_next = (itv.v_begin + itv.v_end) / 2;
+	return true;
+}
+
+inline void DacScanner::add(float current, float voltage)
+{
+	if (flag_done) return;
+	DacScanPoint pt = {v_next, current, voltage};
+	auto it = lower_bound(points.begin(), points.end(), v_next,
+	                      [](const DacScanPoint& p, float v) {return p.dac_voltage < v;});
+	
+	if (flag_sweep) {
+		// the step is chosen by the slope of the last interval
+		float step = step_max;
+		if (! points.empty() && current > points.back().bat_current) {
+			float slope = (current - points.back().bat_current) / (v_next - points.back().dac_voltage);
+			step = current_step / slope;
+			if (step > step_max) step = step_max;
+			if (step < step_min) step = step_min;
+		}
+		points.insert(it, pt);
+		if (current >= i_max) v_next = v_max + 1; //the sweep is finished
+		else v_next += step;
+		return;
+	}
+	
+	Interval itv = intervals.back(); intervals.pop_back();
+	float i_interp = current_at(v_next);
+	points.insert(it, pt);
+	if (fabs(current - i_interp) > tolerance) {
+		add_interval(v_next, itv.v_end); add_interval(itv.v_begin, v_next);
+	}
+}
+
+inline void DacScanner::add_limit()
+{
+	if (flag_done) return;
+	if (flag_sweep) {
+		v_next = v_max + 1; return; //nothing above it is measured
+	}
+	if (! intervals.empty()) intervals.pop_back();
+}
+
+// both points of the interval are measured
+inline void DacScanner::add_interval(float v_begin, float v_end)
+{
+	if (v_end - v_begin < 2 * step_min) return;
+	float i_begin = current_at(v_begin), i_end = current_at(v_end);
+	if (fabs(i_end - i_begin) <= tolerance) return;
+	Interval itv = {v_begin, v_end};
+	intervals.push_back(itv);
+}
+
+inline float DacScanner::current_at(float v_dac) const
+{
+	if (points.empty()) return 0;
+	if (v_dac <= points.front().dac_voltage) return points.front().bat_current;
+	if (v_dac >= points.back().dac_voltage) return points.back().bat_current;
+	
+	auto it = lower_bound(points.begin(), points.end(), v_dac,
+	                      [](const DacScanPoint& p, float v) {return p.dac_voltage < v;});
+	const DacScanPoint& p2 = *it; const DacScanPoint& p1 = *(it - 1);
+	if (p2.dac_voltage == v_dac) return p2.bat_current;
+	return p1.bat_current + (p2.bat_current - p1.bat_current)
+	                      * (v_dac - p1.dac_voltage) / (p2.dac_voltage - p1.dac_voltage);
+}
+
+#endif
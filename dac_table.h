@@ -0,0 +1,218 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef DAC_TABLE_H
+#define DAC_TABLE_H
+
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include "dac_scanner.h"
+
+using namespace std;
+
+struct DacCurrentPoint
+{
+	float dac_voltage, current; //unit: V, A
+};
+
+// DAC voltages and the currents given by them for each device (by its USB serial number),
+// taken from DAC scans and learned while charging. it gives the first DAC voltage of the charge.
+// the file is a count of devices (8-bit), then for each device: the length of the serial
+// number (8-bit), the serial number, count of points (8-bit), then the points as 32-bit floats.
+class DacCurrentTable
+{
+	struct Entry {
+		string serial_number;
+		vector<DacCurrentPoint> points; //sorted by dac_voltage, the current rises with it
+	};
+	vector<Entry> entries; //the recently updated is the first
+	unsigned int cnt_updates = 0; //since it's loaded
+	
+	Entry* find(const string& serial_number);
+	const Entry* find(const string& serial_number) const;
+	Entry& entry_to_update(const string& serial_number);
+
+public:
+	enum {
+		Entries_Max = 16,
+		Points_Max = 24,
+		Scan_Points = 16 //taken from a scanned curve, at equal steps of current
+	};
+	
+	// creates the entry of the device if it doesn't exist, and reserves it to be updated
+	// without allocation
+	void prepare(const string& serial_number);
+	
+	bool load(istream& ist);
+	bool save(ostream& ost) const;
+	unsigned int update_count() const {return cnt_updates;}
+	const vector<DacCurrentPoint>& points(const string& serial_number) const; //empty if it's unknown
+	
+	// returns 0 if the device is unknown, or the current is out of the range of the table
+	float dac_voltage_for(const string& serial_number, float current) const;
+	
+	void set_curve(const string& serial_number, const vector<DacScanPoint>& curve);
+	void learn(const string& serial_number, float dac_voltage, float current); //a stable point
+};
+
+inline DacCurrentTable::Entry* DacCurrentTable::find(const string& serial_number)
+{
+	for (Entry& e : entries)
+		if (e.serial_number == serial_number) return &e;
+	return NULL;
+}
+
+inline const DacCurrentTable::Entry* DacCurrentTable::find(const string& serial_number) const
+{
+	for (const Entry& e : entries)
+		if (e.serial_number == serial_number) return &e;
+	return NULL;
+}
+
+inline void DacCurrentTable::prepare(const string& serial_number)
+{
+	entries.reserve(Entries_Max);
+	Entry* p = find(serial_number);
+	if (! p) {
+		if (entries.size() >= Entries_Max) entries.pop_back(); //the least recently updated
+		Entry e; e.serial_number = serial_number;
+		entries.push_back(e); p = &entries.back();
+	}
+	p->points.reserve(Points_Max + 1); //it's not kept by copying
+}
+
+// moves the entry to the front
+inline DacCurrentTable::Entry& DacCurrentTable::entry_to_update(const string& serial_number)
+{
+	prepare(serial_number);
+	auto it = entries.begin() + (find(serial_number) - entries.data());
+	rotate(entries.begin(), it, it + 1);
+	cnt_updates++;
+	return entries.front();
+}
+
+inline bool DacCurrentTable::load(istream& ist)
+{
+	vector<Entry> loaded;
+	uint8_t cnt_entries = 0;
+	if (! ist.read((char*)&cnt_entries, 1) || cnt_entries > Entries_Max) return false;
+	for (unsigned int i = 0; i < cnt_entries; i++) {
+		Entry e; uint8_t len = 0, cnt_points = 0;
+		if (! ist.read((char*)&len, 1)) return false;
+		e.serial_number.resize(len);
+		if (len && !ist.read(&e.serial_number[0], len)) return false;
+		if (! ist.read((char*)&cnt_points, 1) || cnt_points > Points_Max) return false;
+		e.points.resize(cnt_points);
+		if (cnt_points && !ist.read((char*)e.points.data(), cnt_points * sizeof(DacCurrentPoint)))
+			return false;
+		loaded.push_back(e);
+	}
+	entries.swap(loaded); cnt_updates = 0;
+	return true;
+}
+
+inline bool DacCurrentTable::save(ostream& ost) const
+{
+	uint8_t cnt_entries = count_if(entries.begin(), entries.end(),
+	                               [](const Entry& e) {return ! e.points.empty();});
+	ost.write((const char*)&cnt_entries, 1);
+	for (const Entry& e : entries) {
+		if (e.points.empty()) continue;
+		uint8_t len = (e.serial_number.length() < 255)? e.serial_number.length() : 255,
+		        cnt_points = e.points.size();
+		ost.write((const char*)&len, 1);
+		ost.write(e.serial_number.data(), len);
+		ost.write((const char*)&cnt_points, 1);
+		ost.write((const char*)e.points.data(), cnt_points * sizeof(DacCurrentPoint));
+	}
+	return (bool) ost;
+}
+
+inline const vector<DacCurrentPoint>& DacCurrentTable::points(const string& serial_number) const
+{
+	static const vector<DacCurrentPoint> empty;
+	const Entry* e = find(serial_number);
+	return e? e->points : empty;
+}
+
+inline float DacCurrentTable::dac_voltage_for(const string& serial_number, float current) const
+{
+	const Entry* e = find(serial_number);
+	if (! e) return 0;
+	
+	const vector<DacCurrentPoint>& pts = e->points;
+	for (unsigned int i = 1; i < pts.size(); i++) {
+		const DacCurrentPoint& p1 = pts[i - 1]; const DacCurrentPoint& p2 = pts[i];
+		if (current < p1.current || current > p2.current) continue;
+		if (p2.current == p1.current) return p1.dac_voltage;
+		return p1.dac_voltage + (p2.dac_voltage - p1.dac_voltage)
+		                      * (current - p1.current) / (p2.current - p1.current);
+	}
+	if (pts.size() == 1 && fabs(pts[0].current - current) < 0.02 * current)
+		return pts[0].dac_voltage;
+	return 0;
+}
+
+// the last point without current is kept as the threshold, then points are taken
+// at equal steps of current up to the highest one
+inline void DacCurrentTable::set_curve(const string& serial_number, const vector<DacScanPoint>& curve)
+{
+	if (curve.size() < 2) return;
+	float i_floor = curve.front().bat_current + 0.002, //the offset without current
+	      i_top = curve.back().bat_current;
+	if (i_top <= i_floor) return;
+	
+	Entry& e = entry_to_update(serial_number);
+	e.points.clear();
+	unsigned int k = 0;
+	while (k + 1 < curve.size() && curve[k + 1].bat_current <= i_floor) k++;
+	DacCurrentPoint pt = {curve[k].dac_voltage, curve[k].bat_current};
+	e.points.push_back(pt);
+	
+	for (unsigned int n = 1; n <= Scan_Points; n++) {
+		float current = i_floor + (i_top - i_floor) * n / Scan_Points;
+		while (k + 1 < curve.size() && curve[k + 1].bat_current < current) k++;
+		if (k + 1 >= curve.size()) break;
+		const DacScanPoint& p1 = curve[k]; const DacScanPoint& p2 = curve[k + 1];
+		pt.current = current;
+		pt.dac_voltage = p1.dac_voltage + (p2.dac_voltage - p1.dac_voltage)
+		                               * (current - p1.bat_current) / (p2.bat_current - p1.bat_current);
+		if (pt.dac_voltage > e.points.back().dac_voltage) e.points.push_back(pt);
+	}
+}
+
+// points that are near the new one or conflict with it are replaced
+inline void DacCurrentTable::learn(const string& serial_number, float dac_voltage, float current)
+{
+	Entry& e = entry_to_update(serial_number);
+	vector<DacCurrentPoint>& pts = e.points;
+	float dist = 0.02 * current + 0.002;
+	
+	unsigned int i_new = 0;
+	for (unsigned int i = 0; i < pts.size(); ) {
+		bool conflict = (pts[i].dac_voltage < dac_voltage) != (pts[i].current < current);
+		if (conflict || fabs(pts[i].current - current) < dist) {
+			pts.erase(pts.begin() + i); continue;
+		}
+		if (pts[i].dac_voltage < dac_voltage) i_new = i + 1;
+		i++;
+	}
+	DacCurrentPoint pt = {dac_voltage, current};
+	pts.insert(pts.begin() + i_new, pt);
+	
+	// the neighbour with the closest current is dropped
+	if (pts.size() > Points_Max) {
+		unsigned int i_drop = (i_new == 0)? 1 : i_new - 1;
+		if (i_new > 0 && i_new + 1 < pts.size()
+		&&  pts[i_new + 1].current - current < current - pts[i_new - 1].current)
+			i_drop = i_new + 1;
+		pts.erase(pts.begin() + i_drop);
+	}
+}
+
+#endif
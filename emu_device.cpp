@@ -0,0 +1,310 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#include "emu_device.h"
+
+#include <cstring>
+#include <cmath>
+
+float CircuitModel::current(float v_dac) const
+{
+	// the current is limited by the supply when the MOSFET is fully on
+	float r_total = conf.r_samp + conf.r_extra + conf.bat_ir + conf.mos_r_on;
+	float i_max = (conf.v_ext_power - v_oc()) / r_total;
+	if (i_max <= 0) return 0;
+	
+	// otherwise I = k * (Vgs - Vth)^2, where Vgs = Vdac - I * Rsamp. it's found by bisection.
+	auto excess = [&](float i) {
+		float v_ov = v_dac - i * conf.r_samp - conf.mos_v_th;
+		return ((v_ov > 0)? conf.mos_k * v_ov * v_ov : 0) - i;
+	};
+	if (excess(i_max) >= 0) return i_max;
+	
+	float i_l = 0, i_r = i_max;
+	for (int i = 0; i < 30; i++) {
+		float i_m = (i_l + i_r) / 2;
+		if (excess(i_m) > 0) i_l = i_m; else i_r = i_m;
+	}
+	return i_l;
+}
+
+void CircuitModel::charge(float current, float sec)
+{
+	soc += current * sec / (conf.bat_capacity_mah * 3.6);
+	if (soc > 1.0) soc = 1.0;
+}
+
+void CircuitModel::sample(float i, float noise_1, float noise_2, uint16_t* adc1, uint16_t* adc2) const
+{
+	float v_bat = v_oc() + i * conf.bat_ir;
+	float u_div = (conf.v_ext_power - v_bat - i * conf.r_extra) * conf.div_prop;
+	float u_samp = i * conf.r_samp;
+	
+	auto to_raw = [&](float u, float noise) -> uint16_t {
+		float val = u / conf.vdda * ADC_Raw_Value_Max + noise;
+		if (val < 0) return 0;
+		if (val > ADC_Raw_Value_Max) return ADC_Raw_Value_Max;
+		return (uint16_t) lround(val);
+	};
+	*adc1 = to_raw(u_div, noise_1); *adc2 = to_raw(u_samp, noise_2);
+}
+
+EmuDevice::EmuDevice(const EmuConfig& conf, unsigned int seed):
+	conf(conf), model(conf), rng(seed), noise(0, conf.noise_lsb)
+{
+	memset(&hard_param, 0, sizeof(hard_param));
+	hard_param.resp = comm_resp(Cmd_ID_Check, Resp_OK);
+	hard_param.protocol_key = Protocol_Key;
+	hard_param.dac_support = true;
+	hard_param.pwm_clock_freq = 144000000;
+	hard_param.adc_clock_freq = 12000000;
+	hard_param.adc_bulk_data_amount = conf.bulk_data_amount;
+	hard_param.adc_vrefint = conf.vrefint * 1000;
+	if (conf.bulk_data_amount_max >= conf.bulk_data_amount) {
+		hard_param.capabilities = Capability_ADC_Config;
+		if (conf.data_packed) hard_param.capabilities |= Capability_Data_Packed;
+		if (conf.cmd_seq) hard_param.capabilities |= Capability_Cmd_Seq;
+		if (conf.cmd_batch) hard_param.capabilities |= Capability_Cmd_Batch;
+		hard_param.adc_bulk_data_amount_max = conf.bulk_data_amount_max;
+	} else //as an older firmware
+		hard_param.resp.ext_length = resp_length_min(Cmd_ID_Check) - sizeof(CommResp);
+	
+	const uint16_t opts[8] = {14, 15, 17, 20, 32, 74, 194, 614}; //same as the firmware
+	for (int i = 0; i < 8; i++) hard_param.adc_clock_cycles_opts[i] = opts[i];
+	
+	bulk_data_amount = conf.bulk_data_amount;
+	bulk.resize(2 * ((conf.bulk_data_amount_max > conf.bulk_data_amount)?
+	                 conf.bulk_data_amount_max : conf.bulk_data_amount));
+	
+	// so the emulation doesn't allocate while the host is being checked for allocations
+	buf_encode.reserve(2 * bulk.size());
+	buf_out.reserve(4 * (Data_Header_Length + 2 + 2 * bulk.size()));
+	buf_cmd.reserve(256); buf_stream.reserve(256);
+}
+
+void EmuDevice::advance(steady_clock::time_point t)
+{
+	if (flag_lock && flag_adc_converting && t > t_shake_deadline) {
+		generate(t_shake_deadline);
+		adc_stop(); cnt_shake_timeout++;
+	}
+	generate(t);
+}
+
+void EmuDevice::receive(const void* data, uint32_t sz, steady_clock::time_point t)
+{
+	advance(t); //the command takes effect from now on
+	const uint8_t* p = (const uint8_t*) data;
+	if (! (hard_param.capabilities & Capability_Cmd_Batch)) { //same as the firmware
+		resp_header = Protocol_Header;
+		if (sz >= sizeof(CommCmd) && sz <= UINT8_MAX && is_cmd_header(((const CommCmd*) p)->header)
+		&&  is_valid_cmd(p, sz)) {
+			resp_header = ((const CommCmd*) p)->header; apply_cmd(p, sz, t);
+		} else
+			resp_is_ok(0, false);
+		return;
+	}
+	buf_cmd.insert(buf_cmd.end(), p, p + sz);
+	check_cmd(t);
+}
+
+// a command is given as a packet once all of its bytes are received, a broken byte is given alone
+void EmuDevice::receive_stream(const void* data, uint32_t sz, steady_clock::time_point t)
+{
+	if (hard_param.capabilities & Capability_Cmd_Batch) {
+		receive(data, sz, t); return;
+	}
+	const uint8_t* p = (const uint8_t*) data;
+	buf_stream.insert(buf_stream.end(), p, p + sz);
+	while (buf_stream.size() >= sizeof(CommCmd)) {
+		const CommCmd* cmd = (const CommCmd*) buf_stream.data();
+		uint8_t length = is_cmd_header(cmd->header)? cmd_length(cmd->cmd_id) : 0;
+		if (length == 0) length = 1;
+		else if (buf_stream.size() < length) break;
+		receive(buf_stream.data(), length, t);
+		buf_stream.erase(buf_stream.begin(), buf_stream.begin() + length);
+	}
+}
+
+steady_clock::time_point EmuDevice::next_event() const
+{
+	if (! flag_adc_converting) return steady_clock::time_point::max();
+	
+	microseconds interval((long long)sample_interval_us);
+	steady_clock::time_point t = t_next_sample + interval * (bulk_data_amount - cnt_bulk_data - 1);
+	if (flag_lock && t_shake_deadline < t)
+		t = t_shake_deadline + microseconds(1);
+	return t;
+}
+
+/*------------------------------ private functions ------------------------------*/
+
+// generates samples up to time t, and sends the bulk when it is full
+void EmuDevice::generate(steady_clock::time_point t)
+{
+	if (! flag_adc_converting) return;
+	
+	// the DAC output doesn't change in this call, and the battery changes too slowly
+	// in a bulk interval to affect the current
+	float v_dac = flag_output? (float)dac_val / DAC_Raw_Value_Max * conf.vdda : 0;
+	float i = model.current(v_dac), dt_sec = sample_interval_us / 1e6;
+	while (t_next_sample <= t && flag_adc_converting) {
+		uint16_t* p = &bulk[2 * cnt_bulk_data];
+		model.sample(i, noise(rng), noise(rng), p, p + 1);
+		model.charge(i, dt_sec);
+		t_next_sample += microseconds((long long)sample_interval_us);
+		
+		if (++cnt_bulk_data == bulk_data_amount) {
+			send_bulk(); cnt_bulk_data = 0;
+			if (flag_single_mode) adc_stop();
+		}
+	}
+}
+
+void EmuDevice::send_bulk()
+{
+	uint8_t head[Data_Header_Length + 2];
+	uint32_t header = data_header_of(data_format);
+	uint16_t ad_refint = conf.vrefint / conf.vdda * ADC_Raw_Value_Max;
+	memcpy(head, &header, Data_Header_Length);
+	memcpy(head + Data_Header_Length, &ad_refint, 2);
+	resp(head, sizeof(head));
+	if (data_format == Data_Format_Raw) {
+		resp(bulk.data(), 2 * 2 * bulk_data_amount); return;
+	}
+	
+	// the raw format is the largest
+	buf_encode.resize(2 * 2 * bulk_data_amount);
+	uint32_t sz = 0;
+	for (uint32_t i = 0; i < bulk_data_amount; i += Data_Block_Amount) {
+		uint32_t cnt = bulk_data_amount - i;
+		if (cnt > Data_Block_Amount) cnt = Data_Block_Amount;
+		sz += data_block_encode(data_format, &bulk[2 * i], cnt, &buf_encode[sz]);
+	}
+	resp(buf_encode.data(), sz);
+}
+
+// with Capability_Cmd_Batch, commands are taken from the beginning of the buffer, broken bytes are answered with failure.
+// the response carries the header (with the sequence number) of the command.
+void EmuDevice::check_cmd(steady_clock::time_point t)
+{
+	while (buf_cmd.size() >= sizeof(CommCmd)) {
+		const CommCmd* cmd = (const CommCmd*) buf_cmd.data();
+		uint8_t length = cmd_length(cmd->cmd_id);
+		if (! is_cmd_header(cmd->header) || length == 0) {
+			resp_header = Protocol_Header;
+			resp_is_ok(0, false); buf_cmd.erase(buf_cmd.begin()); continue;
+		}
+		if (buf_cmd.size() < length) break;
+		
+		resp_header = cmd->header;
+		if (is_valid_cmd(buf_cmd.data(), length))
+			apply_cmd(buf_cmd.data(), length, t);
+		else
+			resp_is_ok(0, false);
+		buf_cmd.erase(buf_cmd.begin(), buf_cmd.begin() + length);
+	}
+}
+
+// with a sequence number only if Capability_Cmd_Seq is given
+bool EmuDevice::is_cmd_header(uint32_t header) const
+{
+	if (hard_param.capabilities & Capability_Cmd_Seq) return is_protocol_header(header);
+	return header == Protocol_Header;
+}
+
+// any valid command restarts the shake interval, as an older firmware only the ones of is_keep_alive_cmd()
+void EmuDevice::apply_cmd(const uint8_t* ptr, uint8_t length, steady_clock::time_point t)
+{
+	const CommCmd* cmd = (const CommCmd*) ptr;
+	if ((hard_param.capabilities & Capability_ADC_Config) || is_keep_alive_cmd(cmd->cmd_id))
+		t_shake_deadline = t + milliseconds(Shake_Interval_Max);
+	
+	switch (cmd->cmd_id) {
+		case Cmd_ID_Check: {
+			Resp_Check r = hard_param; r.resp.header = resp_header;
+			resp(&r, sizeof(CommResp) + r.resp.ext_length); break;
+		}
+		
+		case Cmd_ID_ADC_Start:
+			adc_start((const Cmd_ADC_Start*) cmd, t);
+			resp_is_ok(cmd->cmd_id, true); break;
+		
+		case Cmd_ID_ADC_Stop:
+			adc_stop(); resp_is_ok(cmd->cmd_id, true); break;
+		
+		case Cmd_ID_PWM_DAC: {
+			const Cmd_PWM_DAC* cmd_pwm_dac = (const Cmd_PWM_DAC*) cmd;
+			bool suc = !flag_lock || flag_adc_converting || cmd_pwm_dac->dac_val == 0;
+			if (suc) {
+				dac_val = cmd_pwm_dac->dac_val; flag_output = (dac_val > 0);
+			}
+			if (! cmd_pwm_dac->no_resp) resp_is_ok(cmd->cmd_id, suc);
+			break;
+		}
+		
+		case Cmd_ID_Disable_Output:
+			flag_output = false; resp_is_ok(cmd->cmd_id, true); break;
+		
+		case Cmd_ID_Shake:
+			resp_is_ok(cmd->cmd_id, true); break;
+		
+		case Cmd_ID_ADC_Config:
+			resp_is_ok(cmd->cmd_id, adc_config((const Cmd_ADC_Config*) cmd, t)); break;
+		
+		case Cmd_ID_Unlock:
+			flag_lock = false; resp_is_ok(cmd->cmd_id, true); break;
+		
+		case Cmd_ID_Reset:
+			adc_stop(); resp_is_ok(cmd->cmd_id, true);
+			flag_lock = true; dac_val = 0;
+			bulk_data_amount = conf.bulk_data_amount; data_format = Data_Format_Raw; break;
+		
+		default: break;
+	}
+}
+
+void EmuDevice::resp(const void* ptr, uint32_t sz)
+{
+	const uint8_t* p = (const uint8_t*) ptr;
+	buf_out.insert(buf_out.end(), p, p + sz);
+}
+
+void EmuDevice::resp_is_ok(uint8_t cmd_id, bool ok)
+{
+	CommResp r = comm_resp(cmd_id, ok? Resp_OK : Resp_Failed);
+	r.header = resp_header;
+	resp(&r, sizeof(r));
+}
+
+void EmuDevice::adc_start(const Cmd_ADC_Start* cmd, steady_clock::time_point t)
+{
+	flag_single_mode = cmd->discontinous_mode;
+	sample_interval_us = adc_raw_data_interval_ms(&hard_param, cmd->adc_clock_cycles_opt) * 1000;
+	if (sample_interval_us < 1) sample_interval_us = 1;
+	cnt_bulk_data = 0;
+	t_next_sample = t;
+	flag_adc_converting = true;
+}
+
+// the bulk being converted is dropped
+bool EmuDevice::adc_config(const Cmd_ADC_Config* cmd, steady_clock::time_point t)
+{
+	if (! (hard_param.capabilities & Capability_ADC_Config)
+	||  cmd->adc_bulk_data_amount > hard_param.adc_bulk_data_amount_max
+	||  ! hard_param.adc_clock_cycles_opts[cmd->adc_clock_cycles_opt]
+	||  (cmd->data_format != Data_Format_Raw && !(hard_param.capabilities & Capability_Data_Packed)))
+		return false;
+	
+	bulk_data_amount = cmd->adc_bulk_data_amount; data_format = cmd->data_format;
+	sample_interval_us = adc_raw_data_interval_ms(&hard_param, cmd->adc_clock_cycles_opt) * 1000;
+	if (sample_interval_us < 1) sample_interval_us = 1;
+	cnt_bulk_data = 0; t_next_sample = t;
+	return true;
+}
+
+void EmuDevice::adc_stop()
+{
+	flag_adc_converting = false;
+	if (flag_lock) flag_output = false;
+}
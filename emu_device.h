@@ -0,0 +1,115 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef EMU_DEVICE_H
+#define EMU_DEVICE_H
+
+#include <cstdint>
+#include <chrono>
+#include <vector>
+#include <random>
+
+#include "comm_protocol.h"
+
+using namespace std;
+using namespace std::chrono;
+
+struct EmuConfig
+{
+	float vdda = 3.3, vrefint = 1.2,
+	      v_ext_power = 5.0,
+	      div_prop = 5.6 / (3.0 + 5.6),
+	      r_samp = 0.33,
+	      r_extra = 0.05,
+	
+	      mos_v_th = 1.6,    // MOSFET gate threshold voltage (V)
+	      mos_k = 2.0,       // MOSFET transconductance parameter (A/V^2)
+	      mos_r_on = 0.1,    // MOSFET minimum on-resistance (ohm)
+	
+	      bat_v_empty = 1.1, bat_v_full = 1.45, // open-circuit voltage range
+	      bat_capacity_mah = 2000, bat_soc = 0.2,
+	      bat_ir = 0.1,
+	
+	      noise_lsb = 2.0;   // standard deviation of ADC noise
+	
+	uint16_t bulk_data_amount = 3072,
+	         bulk_data_amount_max = 4 * 3072; //0 for a firmware without Cmd_ID_ADC_Config
+	bool data_packed = true; //Capability_Data_Packed, with Cmd_ID_ADC_Config
+	bool cmd_seq = true; //Capability_Cmd_Seq, with Cmd_ID_ADC_Config
+	bool cmd_batch = true; //Capability_Cmd_Batch, with Cmd_ID_ADC_Config
+};
+
+// a battery connected to the charging circuit: DAC -> MOSFET gate, drain current through the
+// battery, the sampling resistor and the extra resistance. ADC1 reads (VSupply - VBattery)
+// through the divider, ADC2 reads the voltage of the sampling resistor.
+class CircuitModel
+{
+	EmuConfig conf;
+	double soc; //the increment of each sample is below the precision of float
+
+public:
+	CircuitModel(const EmuConfig& conf): conf(conf), soc(conf.bat_soc) {}
+	
+	float state_of_charge() const {return soc;}
+	float v_oc() const;
+	float current(float v_dac) const;
+	void charge(float current, float sec);
+	
+	// returns the ADC readings for the current given by current()
+	void sample(float current, float noise_1, float noise_2, uint16_t* adc1, uint16_t* adc2) const;
+};
+
+inline float CircuitModel::v_oc() const
+{
+	return conf.bat_v_empty + (conf.bat_v_full - conf.bat_v_empty) * soc;
+}
+
+// the firmware (draft_stm32f303) without I/O: commands are given by receive(), bytes to be
+// sent are appended to output(). the time is given by the caller, so it can be driven by
+// a real clock (usb_charge_emulator) or a virtual one (SimTransport).
+class EmuDevice
+{
+	EmuConfig conf; CircuitModel model;
+	mt19937 rng; normal_distribution<float> noise;
+	
+	Resp_Check hard_param;
+	bool flag_lock = true, flag_adc_converting = false, flag_single_mode = false;
+	uint16_t dac_val = 0; bool flag_output = false;
+	steady_clock::time_point t_shake_deadline; unsigned int cnt_shake_timeout = 0;
+	
+	float sample_interval_us = 0; steady_clock::time_point t_next_sample;
+	vector<uint16_t> bulk; uint32_t bulk_data_amount, cnt_bulk_data = 0;
+	uint8_t data_format = Data_Format_Raw; vector<uint8_t> buf_encode;
+	vector<uint8_t> buf_cmd, buf_stream, buf_out; uint32_t resp_header = Protocol_Header;
+	
+	void generate(steady_clock::time_point t);
+	void send_bulk();
+	void check_cmd(steady_clock::time_point t);
+	bool is_cmd_header(uint32_t header) const;
+	void apply_cmd(const uint8_t* ptr, uint8_t length, steady_clock::time_point t);
+	void resp(const void* ptr, uint32_t sz);
+	void resp_is_ok(uint8_t cmd_id, bool ok);
+	void adc_start(const Cmd_ADC_Start* cmd, steady_clock::time_point t);
+	bool adc_config(const Cmd_ADC_Config* cmd, steady_clock::time_point t);
+	void adc_stop();
+
+public:
+	EmuDevice(const EmuConfig& conf, unsigned int seed);
+	
+	const CircuitModel& circuit() const {return model;}
+	unsigned int shake_timeout_count() const {return cnt_shake_timeout;}
+	
+	// generates samples up to time t, a full bulk is sent; the output is disabled
+	// if the shake deadline has passed.
+	void advance(steady_clock::time_point t);
+	
+	// a packet from the host. without Capability_Cmd_Batch, it must be exactly one command.
+	void receive(const void* data, uint32_t sz, steady_clock::time_point t);
+	// bytes from a stream without packet boundaries (a pty), they are split into commands first
+	void receive_stream(const void* data, uint32_t sz, steady_clock::time_point t);
+	steady_clock::time_point next_event() const; //when advance() has something to do
+	
+	vector<uint8_t>& output() {return buf_out;} //taken away by the caller
+};
+
+#endif
@@ -0,0 +1,186 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+// emulates the STM32F303 firmware (draft_stm32f303) on pseudo terminals, with the model of
+// the charging circuit in emu_device.h. POSIX only.
+//
+// usage: usb_charge_emulator [--count N] [--link /dev/ttyACM<K>] [--bulk AMOUNT] [--bulk-max AMOUNT]
+//                            [--packed 0|1] [--cmd-seq 0|1] [--cmd-batch 0|1] [--noise LSB] [--soc 0..1]
+//                            [--capacity mAh] [--ir ohm]
+// --bulk-max 0 emulates a firmware without Cmd_ID_ADC_Config.
+// with --link, links /dev/ttyACM<K>, /dev/ttyACM<K+1>... to the ptys (root is required),
+// so usb_charge_control finds them like real devices.
+
+#include "emu_device.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+
+using namespace std;
+using namespace std::chrono;
+
+// one emulated device on a pty
+class PtyDevice
+{
+	EmuDevice dev;
+	int fd = -1; string path_pty, path_link;
+	
+	void flush_output();
+	void write_all(const void* ptr, uint32_t sz);
+
+public:
+	PtyDevice(const EmuConfig& conf, unsigned int seed): dev(conf, seed) {}
+	~PtyDevice();
+	bool open(const string& link);
+	const string& name() const {return path_link.empty()? path_pty : path_link;}
+	void run(volatile bool* flag_close);
+};
+
+PtyDevice::~PtyDevice()
+{
+	if (! path_link.empty()) unlink(path_link.c_str());
+	if (fd >= 0) close(fd);
+}
+
+bool PtyDevice::open(const string& link)
+{
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) return false;
+	path_pty = ptsname(fd);
+	
+	// raw mode, like the CDC-ACM device
+	termios tio;
+	if (tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio); tcsetattr(fd, TCSANOW, &tio);
+	}
+	
+	if (! link.empty()) {
+		unlink(link.c_str());
+		if (symlink(path_pty.c_str(), link.c_str()) != 0) return false;
+		path_link = link;
+	}
+	return true;
+}
+
+void PtyDevice::run(volatile bool* flag_close)
+{
+	while (! *flag_close) {
+		unsigned int cnt_timeout = dev.shake_timeout_count();
+		steady_clock::time_point t = steady_clock::now();
+		dev.advance(t); flush_output();
+		if (dev.shake_timeout_count() != cnt_timeout)
+			fprintf(stderr, "%s: shake timeout, output disabled\n", name().c_str());
+		
+		int timeout_ms = 100;
+		steady_clock::time_point t_next = dev.next_event();
+		if (t_next < t + milliseconds(timeout_ms))
+			timeout_ms = duration_cast<milliseconds>(t_next - t).count() + 1;
+		
+		pollfd pfd = {fd, POLLIN, 0};
+		int r = poll(&pfd, 1, timeout_ms);
+		if (r > 0 && (pfd.revents & POLLHUP)) { //the host hasn't opened the port
+			this_thread::sleep_for(milliseconds(50)); continue;
+		}
+		if (r > 0 && (pfd.revents & POLLIN)) {
+			uint8_t buf[256];
+			ssize_t l = read(fd, buf, sizeof(buf));
+			if (l > 0) {
+				dev.receive_stream(buf, l, steady_clock::now());
+				flush_output();
+			}
+		}
+	}
+}
+
+void PtyDevice::flush_output()
+{
+	vector<uint8_t>& out = dev.output();
+	if (out.empty()) return;
+	write_all(out.data(), out.size());
+	out.clear();
+}
+
+void PtyDevice::write_all(const void* ptr, uint32_t sz)
+{
+	const uint8_t* p = (const uint8_t*) ptr;
+	while (sz > 0) {
+		ssize_t l = write(fd, p, sz);
+		if (l < 0) {
+			if (errno == EAGAIN || errno == EINTR) continue;
+			return; //the host has closed the port
+		}
+		p += l; sz -= l;
+	}
+}
+
+static volatile bool flag_close = false;
+
+static void on_signal(int)
+{
+	flag_close = true;
+}
+
+int main(int argc, char** argv)
+{
+	EmuConfig conf;
+	unsigned int cnt_devices = 1; string link;
+	
+	for (int i = 1; i < argc; i++) {
+		string opt = argv[i];
+		if (i + 1 >= argc) {
+			fprintf(stderr, "missing value of %s\n", opt.c_str()); return 1;
+		}
+		const char* val = argv[++i];
+		if (opt == "--count") cnt_devices = atoi(val);
+		else if (opt == "--link") link = val;
+		else if (opt == "--bulk") conf.bulk_data_amount = atoi(val);
+		else if (opt == "--bulk-max") conf.bulk_data_amount_max = atoi(val);
+		else if (opt == "--packed") conf.data_packed = atoi(val);
+		else if (opt == "--cmd-seq") conf.cmd_seq = atoi(val);
+		else if (opt == "--cmd-batch") conf.cmd_batch = atoi(val);
+		else if (opt == "--noise") conf.noise_lsb = atof(val);
+		else if (opt == "--soc") conf.bat_soc = atof(val);
+		else if (opt == "--capacity") conf.bat_capacity_mah = atof(val);
+		else if (opt == "--ir") conf.bat_ir = atof(val);
+		else {
+			fprintf(stderr, "unknown option %s\n", opt.c_str()); return 1;
+		}
+	}
+	if (cnt_devices < 1 || conf.bulk_data_amount < 1) return 1;
+	
+	signal(SIGINT, on_signal); signal(SIGTERM, on_signal);
+	
+	// the number at the end of the link name is increased for each device
+	size_t pos_num = link.find_last_not_of("0123456789") + 1;
+	int num_link = (pos_num < link.size())? atoi(link.c_str() + pos_num) : 0;
+	
+	vector<PtyDevice*> devices; vector<thread> threads;
+	for (unsigned int i = 0; i < cnt_devices; i++) {
+		string link_dev;
+		if (! link.empty()) link_dev = link.substr(0, pos_num) + to_string(num_link + i);
+		
+		PtyDevice* dev = new PtyDevice(conf, i + 1);
+		if (! dev->open(link_dev)) {
+			fprintf(stderr, "failed to create the pty %s\n", link_dev.c_str()); return 1;
+		}
+		printf("%s\n", dev->name().c_str()); fflush(stdout);
+		devices.push_back(dev);
+	}
+	
+	for (PtyDevice* dev : devices)
+		threads.emplace_back(&PtyDevice::run, dev, &flag_close);
+	for (thread& th : threads) th.join();
+	for (PtyDevice* dev : devices) delete dev;
+	return 0;
+}
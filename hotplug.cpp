@@ -0,0 +1,89 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#include "hotplug.h"
+
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#ifdef __linux__
+	#include <unistd.h>
+	#include <poll.h>
+	#include <sys/inotify.h>
+	#include <sys/eventfd.h>
+#endif
+
+#ifdef __linux__
+
+HotplugMonitor::HotplugMonitor()
+{
+	fd_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd_inotify < 0) return;
+	
+	// udev creates the node, then sets its permission
+	if (inotify_add_watch(fd_inotify, "/dev", IN_CREATE | IN_ATTRIB) < 0
+	||  (fd_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		close(fd_inotify); fd_inotify = -1;
+	}
+}
+
+HotplugMonitor::~HotplugMonitor()
+{
+	if (fd_inotify >= 0) close(fd_inotify);
+	if (fd_wake >= 0) close(fd_wake);
+}
+
+bool HotplugMonitor::wait(uint32_t timeout_ms, vector<string>* port_names)
+{
+	if (fd_inotify < 0) {
+		this_thread::sleep_for(chrono::milliseconds(timeout_ms)); return false;
+	}
+	
+	pollfd fds[2] = {{fd_inotify, POLLIN, 0}, {fd_wake, POLLIN, 0}};
+	if (poll(fds, 2, timeout_ms) <= 0) return false;
+	
+	if (fds[1].revents & POLLIN) {
+		uint64_t val; read(fd_wake, &val, sizeof(val)); return false;
+	}
+	
+	// the events are drained, every ttyACM node among them is taken (IN_CREATE and IN_ATTRIB of
+	// the same node are given together)
+	alignas(inotify_event) char buf[4096];
+	bool found = false; ssize_t l;
+	if (port_names) port_names->clear();
+	while ((l = read(fd_inotify, buf, sizeof(buf))) > 0) {
+		for (char* p = buf; p < buf + l; ) {
+			inotify_event* ev = (inotify_event*) p;
+			if (ev->len && string(ev->name).compare(0, 6, "ttyACM") == 0) {
+				string name = string("/dev/") + ev->name;
+				if (port_names && find(port_names->begin(), port_names->end(), name) == port_names->end())
+					port_names->push_back(name);
+				found = true;
+			}
+			p += sizeof(inotify_event) + ev->len;
+		}
+	}
+	return found;
+}
+
+void HotplugMonitor::interrupt()
+{
+	if (fd_wake < 0) return;
+	uint64_t val = 1; write(fd_wake, &val, sizeof(val));
+}
+
+#else
+
+HotplugMonitor::HotplugMonitor() {}
+HotplugMonitor::~HotplugMonitor() {}
+
+bool HotplugMonitor::wait(uint32_t timeout_ms, vector<string>* port_names)
+{
+	this_thread::sleep_for(chrono::milliseconds(timeout_ms));
+	return false;
+}
+
+void HotplugMonitor::interrupt() {}
+
+#endif
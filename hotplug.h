@@ -0,0 +1,38 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// watches /dev for new (or newly accessible) ttyACM nodes by inotify. it is not available
+// on other systems, then wait() only sleeps, and the caller should scan all ports instead.
+class HotplugMonitor
+{
+	int fd_inotify = -1, fd_wake = -1;
+
+public:
+	HotplugMonitor();
+	HotplugMonitor(const HotplugMonitor&) = delete;
+	HotplugMonitor& operator=(const HotplugMonitor&) = delete;
+	~HotplugMonitor();
+	
+	bool is_available() const;
+	
+	// blocks until ports appear (returns true with their paths, each of them once, in the order
+	// of the events), timeout or interrupt().
+	bool wait(uint32_t timeout_ms, vector<string>* port_names);
+	void interrupt();
+};
+
+inline bool HotplugMonitor::is_available() const
+{
+	return fd_inotify >= 0;
+}
+
+#endif
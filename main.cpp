@@ -12,6 +12,7 @@ ChargeControlLayer ctrl;
 UILayer ui;
 
 const string conf_file_name = "charge_control_config.bin";
+const string dac_table_file_name = "dac_current_table.bin";
 
 int main(int argc, char** argv)
 {
@@ -27,6 +28,13 @@ int main(int argc, char** argv)
 		ifs.close();
 	}
 	
+	ifstream ifs_table(path + dac_table_file_name, ios::binary);
+	if (ifs_table) {
+		DacCurrentTable table;
+		if (table.load(ifs_table)) ctrl.set_dac_current_table(table);
+		ifs_table.close();
+	}
+	
 	ui.init(&ctrl);
 	ui.run(); //blocks
 	
@@ -36,5 +44,11 @@ int main(int argc, char** argv)
 		if (ofs) ofs.write((char*)&conf, sizeof(conf));
 	}
 	
+	DacCurrentTable table = ctrl.dac_current_table();
+	if (table.update_count() > 0) { //learned or scanned
+		ofstream ofs(path + dac_table_file_name, ios::binary | ios::trunc);
+		if (ofs) table.save(ofs);
+	}
+	
 	return 0;
 }
@@ -0,0 +1,216 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+// runs a charge with ChargeControlLayer and an emulated device (emu_device.h) on a VirtualClock,
+// so an hour of charging takes a few seconds. the exit status is 0 if the charge is completed.
+//
+// usage: usb_charge_sim [--bulk AMOUNT] [--bulk-max AMOUNT] [--packed 0|1] [--format raw|packed|delta]
+//                       [--cmd-seq 0|1] [--cmd-batch 0|1] [--noise LSB] [--soc 0..1] [--capacity mAh]
+//                       [--ir ohm] [--current A] [--voltage V] [--voltage-oc V] [--charge C]
+//                       [--cv 0|1] [--min-current A] [--time-limit sec] [--seed N]
+//                       [--regulator step|pi] [--dac-table FILE] [--alloc-check 0|1]
+// with --alloc-check 1, the exit status is 3 if the heap is used while charging steadily
+// (from Alloc_Check_Delay after the start until the charge is finished).
+// the DAC-to-current table (dac_table.h) is loaded from FILE if it exists, and saved after the charge.
+
+#include "control_layer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <fstream>
+#include <atomic>
+#include <new>
+
+using namespace std;
+
+// allocations of all threads are counted, the emulated device doesn't allocate after its construction
+static atomic<unsigned long> cnt_alloc(0);
+
+void* operator new(size_t sz)
+{
+	cnt_alloc++;
+	void* p = malloc(sz? sz : 1);
+	if (! p) throw bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept {free(p);}
+void operator delete(void* p, size_t) noexcept {free(p);}
+
+const unsigned long Alloc_Check_Delay = 60 * 1000; //ms
+
+static const char* stop_cause_name(ChargeStopFlag flag)
+{
+	switch (flag) {
+		case StopFlag_Brake:           return "brake";
+		case StopFlag_Time_Limit:      return "time_limit";
+		case StopFlag_Exp_Charge:      return "exp_charge";
+		case StopFlag_Exp_Voltage_OC:  return "exp_voltage_oc";
+		case StopFlag_Exp_Voltage:     return "exp_voltage";
+		case StopFlag_VBat_Decline:    return "vbat_decline";
+		case StopFlag_Min_Current:     return "min_current";
+		case StopFlag_Manual:          return "manual";
+		default:                       return "unknown";
+	}
+}
+
+// the result is taken when the control layer raises the event, as the state is changed
+// more than once while it is stopping the charge
+class SimObserver
+{
+public:
+	volatile bool flag_finished = false;
+	void event_callback(ChargeControlEvent ev);
+};
+
+void SimObserver::event_callback(ChargeControlEvent ev)
+{
+	if (ev == Event_Charge_Complete || ev == Event_Charge_Brake
+	||  ev == Event_Device_Disconnect || ev == Event_Battery_Disconnect)
+		flag_finished = true;
+}
+
+// sleeps on the virtual clock until the condition holds, returns false on timeout
+template <typename Pred>
+static bool sim_wait(ClockSource* clock, unsigned long timeout_ms, Pred pred)
+{
+	steady_clock::time_point t_start = clock->now();
+	while (! pred()) {
+		if (clock->ms_since(t_start) >= timeout_ms) return false;
+		clock->sleep_for(milliseconds(100));
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	EmuConfig emu_conf; ChargeParameters param;
+	unsigned int seed = 1; bool alloc_check = false;
+	uint8_t data_format = Data_Format_Delta; //asked for if the device is --packed
+	string dac_table_path;
+	
+	for (int i = 1; i < argc; i++) {
+		string opt = argv[i];
+		if (i + 1 >= argc) {
+			fprintf(stderr, "missing value of %s\n", opt.c_str()); return 2;
+		}
+		const char* val = argv[++i];
+		if (opt == "--bulk") emu_conf.bulk_data_amount = atoi(val);
+		else if (opt == "--bulk-max") emu_conf.bulk_data_amount_max = atoi(val);
+		else if (opt == "--packed") emu_conf.data_packed = atoi(val);
+		else if (opt == "--format") {
+			string fmt = val;
+			if (fmt == "raw") data_format = Data_Format_Raw;
+			else if (fmt == "packed") data_format = Data_Format_Packed;
+			else if (fmt == "delta") data_format = Data_Format_Delta;
+			else {
+				fprintf(stderr, "unknown data format %s\n", val); return 2;
+			}
+		}
+		else if (opt == "--cmd-seq") emu_conf.cmd_seq = atoi(val);
+		else if (opt == "--cmd-batch") emu_conf.cmd_batch = atoi(val);
+		else if (opt == "--noise") emu_conf.noise_lsb = atof(val);
+		else if (opt == "--soc") emu_conf.bat_soc = atof(val);
+		else if (opt == "--capacity") emu_conf.bat_capacity_mah = atof(val);
+		else if (opt == "--ir") emu_conf.bat_ir = atof(val);
+		else if (opt == "--current") param.exp_current = atof(val);
+		else if (opt == "--voltage") param.exp_voltage = atof(val);
+		else if (opt == "--voltage-oc") param.exp_voltage_oc = atof(val);
+		else if (opt == "--charge") param.exp_charge = atof(val);
+		else if (opt == "--cv") param.opt_stage_const_v = atoi(val);
+		else if (opt == "--min-current") param.min_current = atof(val);
+		else if (opt == "--time-limit") param.time_limit_sec = atoi(val);
+		else if (opt == "--regulator") {
+			string reg = val;
+			if (reg == "step") param.regulator = Regulator_Step;
+			else if (reg == "pi") param.regulator = Regulator_PI;
+			else {
+				fprintf(stderr, "unknown regulator %s\n", val); return 2;
+			}
+		}
+		else if (opt == "--seed") seed = atoi(val);
+		else if (opt == "--alloc-check") alloc_check = atoi(val);
+		else if (opt == "--dac-table") dac_table_path = val;
+		else {
+			fprintf(stderr, "unknown option %s\n", opt.c_str()); return 2;
+		}
+	}
+	if (emu_conf.bulk_data_amount < 1) return 2;
+	
+	VirtualClock clock; clock.add_thread(); //this thread
+	steady_clock::time_point t_real = steady_clock::now();
+	
+	SimTransport* transport = new SimTransport(&clock, emu_conf, seed);
+	ChargeControlLayer* ctrl = new ChargeControlLayer(&clock, transport);
+	ctrl->set_data_format(data_format);
+	SimObserver observer;
+	ctrl->set_event_callback_ptr(
+		MemberFuncEventCallbackPtr<SimObserver, &SimObserver::event_callback>(&observer));
+	
+	// the same circuit as the emulated one
+	ChargeControlConfig conf = ctrl->hard_config();
+	conf.v_refint = emu_conf.vrefint; conf.v_ext_power = emu_conf.v_ext_power;
+	conf.div_prop = emu_conf.div_prop; conf.r_samp = emu_conf.r_samp; conf.r_extra = emu_conf.r_extra;
+	ctrl->set_hard_config(conf);
+	
+	if (! dac_table_path.empty()) {
+		ifstream ifs(dac_table_path, ios::binary);
+		DacCurrentTable table;
+		if (ifs && table.load(ifs)) ctrl->set_dac_current_table(table);
+	}
+	
+	int result = 1;
+	if (! sim_wait(&clock, 60 * 1000, [ctrl] {return ctrl->control_status().control_state == Battery_Connected;})) {
+		fprintf(stderr, "battery is not detected\n");
+	} else if (! ctrl->set_charge_param(param) || ! ctrl->start_charging()) {
+		fprintf(stderr, "invalid charge parameters\n");
+	} else {
+		steady_clock::time_point t_start = clock.now();
+		observer.flag_finished = false;
+		sim_wait(&clock, Alloc_Check_Delay, [&observer] {return observer.flag_finished;});
+		unsigned long cnt_alloc_steady = cnt_alloc;
+		sim_wait(&clock, (param.time_limit_sec + 600) * 1000UL, [&observer] {return observer.flag_finished;});
+		cnt_alloc_steady = cnt_alloc - cnt_alloc_steady;
+		ChargeStatus st = ctrl->control_status();
+		
+		if (st.control_state == Charge_Completed) result = 0;
+		if (alloc_check && cnt_alloc_steady > 0) result = 3;
+		printf("state: %s, cause: %s\n",
+		       (st.control_state == Charge_Completed)? "completed" :
+		       (st.control_state == Charge_Stopped)? "stopped" : "not finished",
+		       stop_cause_name(st.stop_cause));
+		printf("time: %.1f s (simulated), %.1f s (real)\n",
+		       clock.ms_since(t_start) / 1000.0, ms_since(t_real) / 1000.0);
+		printf("charge: %.1f mAh, %.1f J\n", st.bat_charge / 3.6, st.bat_energy);
+		printf("voltage: %.4f V -> %.4f V (max %.4f V), ir: %.4f ohm\n", st.bat_voltage_initial,
+		       st.bat_voltage_final, st.bat_voltage_max, st.ir);
+		printf("internal resistance measured %u times, %.1f s lost\n", st.cnt_ir_measure, st.t_ir_lost);
+		if (st.t_settling >= 0)
+			printf("regulation: settled in %.1f s, overshoot %.1f mA\n", st.t_settling, st.i_overshoot * 1000);
+		else
+			printf("regulation: not settled, overshoot %.1f mA\n", st.i_overshoot * 1000);
+		printf("heap allocations while charging steadily: %lu\n", cnt_alloc_steady);
+		
+		// the latencies are on the virtual clock, which doesn't advance while the threads are running,
+		// so they are the waits for the simulated time (for a bulk or a timer), not the computation
+		LatencyHistogram lat = ctrl->decision_latency(); CommStatistics cs = ctrl->comm_statistics();
+		printf("decision latency: %.0f us (average), %u us (99th percentile)\n",
+		       lat.average_us(), lat.percentile_us(99));
+		printf("wake latency: %.0f us (average), %u us (99th percentile)\n",
+		       cs.wake_latency.average_us(), cs.wake_latency.percentile_us(99));
+		printf("bulks: %lu received, %lu dropped\n", cs.cnt_bulks_received, cs.cnt_bulks_dropped);
+		printf("writes: %lu with %lu commands, %.1f per second at last\n",
+		       cs.cnt_writes, cs.cnt_cmds_written, cs.writes_per_sec);
+	}
+	
+	if (! dac_table_path.empty() && ctrl->dac_current_table().update_count() > 0) {
+		ofstream ofs(dac_table_path, ios::binary | ios::trunc);
+		if (! ofs || ! ctrl->dac_current_table().save(ofs))
+			fprintf(stderr, "failed to save %s\n", dac_table_path.c_str());
+	}
+	
+	delete ctrl; //the transport is deleted with it
+	clock.remove_thread();
+	return result;
+}
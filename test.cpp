@@ -0,0 +1,938 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+// checks the optimized data paths against the original ones on synthetic data, the replay
+// of a capture recorded from the emulated device, and CommLayer with the emulated device.
+// the exit status is 0 if all checks pass.
+// with --bench, the paths are measured instead.
+//
+// usage: usb_charge_test [--bench]
+
+#include "comm_average.h"
+#include "comm_buffer.h"
+#include "comm_codec.h"
+#include "comm_layer.h"
+#include "windowed_stats.h"
+#include "dac_table.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <functional>
+#include <deque>
+#include <sstream>
+
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <poll.h>
+	#include <termios.h>
+#endif
+
+using namespace std;
+using namespace std::chrono;
+
+static unsigned int cnt_failed = 0;
+
+#define check(cond, ...) { \
+	if (! (cond)) { \
+		cnt_failed++; printf("FAILED: " __VA_ARGS__); printf("\n"); \
+	} \
+}
+
+// the original get_stable_average() in comm_layer.cpp, which sorts out the extreme values
+// by repeated scans. it is the reference of the histogram version.
+static float get_stable_average_orig(const uint16_t* raw_data, unsigned int cnt, float diff_max)
+{
+	if (raw_data == NULL || cnt == 0) return 0;
+	
+	uint16_t* data = new uint16_t[cnt];
+	uint32_t sum = 0;
+	for (uint16_t i = 0; i < cnt; i++) {
+		data[i] = raw_data[i];
+		sum += raw_data[i];
+	}
+	
+	uint16_t border = cnt / 8;
+	uint16_t cnt_rem = cnt;
+	uint16_t curr_min = 0, curr_max = 0;
+	uint16_t pmin, pmax;
+	for (uint16_t i = 0; i <= border; i++) {
+		curr_min = UINT16_MAX; curr_max = 0;
+		pmin = pmax = UINT16_MAX;
+		
+		for (uint16_t j = 0; j < cnt; j++) {
+			if (data[j] == UINT16_MAX) continue;
+			if (data[j] < curr_min) {
+				pmin = j;
+				curr_min = data[j];
+			}
+			if (data[j] > curr_max) {
+				pmax = j;
+				curr_max = data[j];
+			}
+		}
+		
+		if (i == border) break;
+		if (pmin == UINT16_MAX || pmax == UINT16_MAX) break;
+		sum -= raw_data[pmin]; sum -= raw_data[pmax];
+		cnt_rem -= 2;
+		
+		data[pmin] = data[pmax] = UINT16_MAX;
+	}
+	delete[] data;
+	
+	if ((curr_max - curr_min) / 2 > 8 * diff_max) return 0;
+	float av1 = (float)sum / cnt_rem;
+	
+	float av2 = 0;
+	sum = 0; cnt_rem = 0;
+	for (uint16_t i = 0; i < cnt; i++) {
+		if (fabs(raw_data[i] - av1) <= diff_max) {
+			sum += raw_data[i];
+			cnt_rem++;
+		}
+	}
+	if (cnt_rem == 0) return 0;
+	av2 = (float)sum / cnt_rem;
+	return av2;
+}
+
+// the original path of process_data(): the pairs are copied into two arrays, then each is averaged
+static void get_stable_averages_orig(const uint16_t* raw_pairs, unsigned int cnt, float diff_max,
+                                     float* av_1, float* av_2)
+{
+	vector<uint16_t> adc1(cnt), adc2(cnt);
+	for (unsigned int i = 0; i < cnt; i++) {
+		adc1[i] = raw_pairs[2 * i]; adc2[i] = raw_pairs[2 * i + 1];
+	}
+	*av_1 = get_stable_average_orig(adc1.data(), cnt, diff_max);
+	*av_2 = get_stable_average_orig(adc2.data(), cnt, diff_max);
+}
+
+// interleaved ADC1/ADC2 readings with gaussian noise around a level, and some spikes
+class SyntheticData
+{
+	mt19937 rng;
+
+public:
+	SyntheticData(unsigned int seed): rng(seed) {}
+	void fill(uint16_t* pairs, unsigned int cnt, float noise_lsb, float spike_prop);
+};
+
+void SyntheticData::fill(uint16_t* pairs, unsigned int cnt, float noise_lsb, float spike_prop)
+{
+	uniform_real_distribution<float> level(0, ADC_Raw_Value_Max), prop(0, 1);
+	normal_distribution<float> noise(0, noise_lsb);
+	float lv[2] = {level(rng), level(rng)};
+	for (unsigned int i = 0; i < 2 * cnt; i++) {
+		float v = lv[i % 2] + noise(rng);
+		if (prop(rng) < spike_prop) v = level(rng);
+		if (v < 0) v = 0;
+		if (v > ADC_Raw_Value_Max) v = ADC_Raw_Value_Max;
+		pairs[i] = lround(v);
+	}
+}
+
+static bool same_float(float a, float b)
+{
+	return memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+// the histogram version gives the same bits as the original, with chunk sizes which are not
+// multiples of 8, narrow and wide noise, spikes, and the limits of the 12-bit range
+static void test_stable_average()
+{
+	SyntheticData gen(1);
+	const unsigned int sizes[] = {1, 2, 7, 8, 9, 64, 127, 128, 200, 256};
+	const float noises[] = {0, 0.5, 2, 8, 40, 400}, spikes[] = {0, 0.01, 0.2};
+	const float radii[] = {8, 2.5, 30};
+	vector<uint16_t> pairs(2 * 256);
+	unsigned int cnt_checked = 0, cnt_zero = 0;
+	
+	for (unsigned int sz : sizes)
+	for (float noise : noises)
+	for (float spike : spikes)
+	for (float radius : radii)
+	for (int n = 0; n < 20; n++) {
+		gen.fill(pairs.data(), sz, noise, spike);
+		if (n == 0) //the lowest and highest codes
+			for (unsigned int i = 0; i < sz; i++) pairs[2 * i] = (i % 2)? ADC_Raw_Value_Max : 0;
+		
+		float av1, av2, ref1, ref2;
+		get_stable_averages(pairs.data(), sz, radius, &av1, &av2);
+		get_stable_averages_orig(pairs.data(), sz, radius, &ref1, &ref2);
+		check(same_float(av1, ref1) && same_float(av2, ref2),
+		      "stable average of %u pairs (noise %.1f, spikes %.2f, radius %.1f): %.6f %.6f, "
+		      "expected %.6f %.6f", sz, noise, spike, radius, av1, av2, ref1, ref2);
+		cnt_checked += 2; cnt_zero += (ref1 == 0) + (ref2 == 0);
+	}
+	printf("stable average: %u chunks checked (%u invalid)\n", cnt_checked, cnt_zero);
+}
+
+// the paths of pair_stats() which can run on this machine
+struct PairStatsPath
+{
+	const char* name;
+	void (*func)(const uint16_t*, uint32_t, PairStats*);
+};
+
+static vector<PairStatsPath> pair_stats_paths()
+{
+	vector<PairStatsPath> paths;
+	paths.push_back({"scalar", pair_stats_scalar});
+#ifdef COMM_AVERAGE_X86
+	if (__builtin_cpu_supports("sse2")) paths.push_back({"sse2", pair_stats_sse2});
+	if (__builtin_cpu_supports("avx2")) paths.push_back({"avx2", pair_stats_avx2});
+#endif
+#ifdef COMM_AVERAGE_NEON
+	paths.push_back({"neon", pair_stats_neon});
+#endif
+	return paths;
+}
+
+static bool same_stats(const PairStats& a, const PairStats& b)
+{
+	for (int ch = 0; ch < 2; ch++)
+		if (a.sum[ch] != b.sum[ch] || a.sum_sq[ch] != b.sum_sq[ch] || a.min[ch] != b.min[ch]
+		||  a.max[ch] != b.max[ch] || a.bits[ch] != b.bits[ch])
+			return false;
+	return true;
+}
+
+// each vector path gives the same sums as the scalar one, with counts which are not multiples
+// of the vector width, unaligned data, and any 16-bit values (including invalid readings)
+static void test_pair_stats()
+{
+	vector<PairStatsPath> paths = pair_stats_paths();
+	mt19937 rng(3);
+	uniform_int_distribution<unsigned int> any(0, UINT16_MAX), code(0, ADC_Raw_Value_Max);
+	vector<uint16_t> buf(2 * 3072 + 1);
+	const uint32_t counts[] = {0, 1, 3, 4, 7, 8, 9, 15, 16, 17, 127, 128, 129, 3072};
+	unsigned int cnt_checked = 0;
+	
+	for (uint32_t cnt : counts)
+	for (int offset = 0; offset < 2; offset++) //by one reading, the pairs are still contiguous
+	for (int n = 0; n < 50; n++) {
+		for (uint16_t& v : buf) v = (n % 5 == 0)? any(rng) : code(rng);
+		if (n % 5 == 1) //the limits
+			for (unsigned int i = 0; i < buf.size(); i++) buf[i] = (i % 3)? UINT16_MAX : 0;
+		
+		const uint16_t* pairs = buf.data() + offset;
+		PairStats ref; pair_stats_scalar(pairs, cnt, &ref);
+		for (const PairStatsPath& path : paths) {
+			PairStats st; path.func(pairs, cnt, &st);
+			check(same_stats(st, ref), "pair stats (%s) of %u pairs at offset %d", path.name, cnt, offset);
+			cnt_checked++;
+		}
+		PairStats st; pair_stats(pairs, cnt, &st);
+		check(same_stats(st, ref), "pair stats (dispatched) of %u pairs", cnt);
+	}
+	printf("pair stats: %u results checked, paths:", cnt_checked);
+	for (const PairStatsPath& path : paths) printf(" %s", path.name);
+	printf("\n");
+}
+
+// each format gives back the readings written by data_block_encode(), with partial blocks, flat and
+// noisy readings, and the limits of the 12-bit range. the SSSE3 unpacker gives the same as the scalar one.
+static void test_codec()
+{
+	SyntheticData data(4);
+	const uint8_t formats[] = {Data_Format_Raw, Data_Format_Packed, Data_Format_Delta};
+	const uint32_t counts[] = {1, 2, 3, 5, 6, 7, 8, 9, 63, Data_Block_Amount};
+	const float noises[] = {0, 2, 30, 1000};
+	vector<uint16_t> pairs(2 * Data_Block_Amount), dec(2 * Data_Block_Amount);
+	vector<uint8_t> buf(2 * 2 * Data_Block_Amount);
+	unsigned int cnt_checked = 0;
+	
+	for (uint8_t format : formats)
+	for (uint32_t cnt : counts)
+	for (float noise : noises)
+	for (int n = 0; n < 10; n++) {
+		if (n == 9) //the limits
+			for (unsigned int i = 0; i < 2 * cnt; i++) pairs[i] = (i % 3)? ADC_Raw_Value_Max : 0;
+		else
+			data.fill(pairs.data(), cnt, noise, (noise > 0)? 0.01 : 0);
+		uint32_t sz = data_block_encode(format, pairs.data(), cnt, buf.data());
+		uint32_t sz_dec = data_block_decode(format, buf.data(), cnt, dec.data());
+		check(sz_dec == sz && equal(pairs.begin(), pairs.begin() + 2 * cnt, dec.begin()),
+		      "block of %u readings in format %u, noise %.0f LSB", cnt, format, noise);
+		cnt_checked++;
+	}
+	
+#ifdef COMM_CODEC_SSSE3
+	if (__builtin_cpu_supports("ssse3")) {
+		mt19937 rng(4);
+		uniform_int_distribution<unsigned int> byte(0, UINT8_MAX);
+		vector<uint16_t> ref(dec.size());
+		for (uint32_t cnt = 0; cnt <= Data_Block_Amount; cnt++) {
+			for (uint8_t& b : buf) b = byte(rng);
+			fill(dec.begin(), dec.end(), UINT16_MAX); fill(ref.begin(), ref.end(), UINT16_MAX);
+			data_unpack_12b_ssse3(buf.data(), cnt, dec.data());
+			data_unpack_12b_scalar(buf.data(), cnt, ref.data());
+			check(dec == ref, "unpacking (ssse3) of %u readings", cnt); //nothing written past them
+			cnt_checked++;
+		}
+	}
+#endif
+	printf("codec: %u blocks checked\n", cnt_checked);
+}
+
+// WindowedStats gives the same as a brute-force scan of a deque holding the window, with rising,
+// falling and repeated values, and clear() at any point
+template <unsigned int N>
+static unsigned int test_windowed_stats_n(mt19937& rng)
+{
+	uniform_real_distribution<float> level(-5, 5), prop(0, 1);
+	WindowedStats<float, N> ws; deque<float> ref;
+	unsigned int cnt_checked = 0; float val = 0;
+	
+	for (int i = 0; i < 20000; i++) {
+		float p = prop(rng);
+		if (p < 0.002) {
+			ws.clear(); ref.clear();
+		} else {
+			if (p < 0.3) val += 0.1; //rising
+			else if (p < 0.6) val -= 0.1; //falling
+			else if (p < 0.9) val = level(rng);
+			ws.push(val); ref.push_back(val); //the same value otherwise
+			if (ref.size() > N) ref.pop_front();
+		}
+		
+		double sum = 0, sum_sq = 0; float v_min = 0, v_max = 0;
+		if (! ref.empty()) v_min = v_max = ref.front();
+		for (float v : ref) {
+			sum += v; v_min = min(v_min, v); v_max = max(v_max, v);
+		}
+		double av = ref.empty()? 0 : sum / ref.size();
+		for (float v : ref) sum_sq += (v - av) * (v - av);
+		double var = ref.empty()? 0 : sum_sq / ref.size();
+		
+		check(ws.count() == ref.size() && ws.get_min() == v_min && ws.get_max() == v_max
+		      && fabs(ws.get_average() - av) < 1e-4 && fabs(ws.get_variance() - var) < 1e-3,
+		      "windowed stats of %u at step %d: %u values, min %f (%f), max %f (%f), average %f (%f), "
+		      "variance %f (%f)", N, i, ws.count(), ws.get_min(), v_min, ws.get_max(), v_max,
+		      ws.get_average(), av, ws.get_variance(), var);
+		cnt_checked++;
+	}
+	return cnt_checked;
+}
+
+static void test_windowed_stats()
+{
+	mt19937 rng(5);
+	unsigned int cnt_checked = test_windowed_stats_n<1>(rng) + test_windowed_stats_n<2>(rng)
+	                         + test_windowed_stats_n<7>(rng) + test_windowed_stats_n<64>(rng);
+	printf("windowed stats: %u steps checked\n", cnt_checked);
+}
+
+// the scanned curve of the emulated circuit is close to CircuitModel::current() from 0 to the current
+// limit (or VDDA, if the current can't reach it), for MOSFETs of different thresholds and transconductances
+static void test_dac_scanner()
+{
+	const float v_ths[] = {0.8, 1.6, 2.4}, ks[] = {0.5, 2.0, 8.0};
+	const float step_max = 0.1, step_min = 0.005, i_max = 1.0, tolerance = 0.001;
+	float err_max = 0; unsigned int cnt_points_max = 0;
+	
+	for (float v_th : v_ths)
+	for (float k : ks) {
+		EmuConfig emu_conf; emu_conf.mos_v_th = v_th; emu_conf.mos_k = k;
+		CircuitModel model(emu_conf);
+		DacScanner scanner(step_max, 0.02, tolerance);
+		scanner.start(emu_conf.vdda, step_min, i_max);
+		float v_dac; unsigned int cnt = 0;
+		while (scanner.next(&v_dac) && cnt++ < 1000)
+			scanner.add(model.current(v_dac), model.v_oc());
+		check(scanner.is_done(), "scan with Vth %.1f V, k %.1f A/V^2 isn't done in %u steps", v_th, k, cnt);
+		
+		const vector<DacScanPoint>& curve = scanner.curve();
+		float v_end = curve.back().dac_voltage, err = 0;
+		for (float v = 0; v <= v_end; v += step_min / 4)
+			err = max(err, fabs(scanner.current_at(v) - model.current(v)));
+		check(err < 5 * tolerance && (curve.back().bat_current >= i_max || v_end + step_max > emu_conf.vdda),
+		      "scan with Vth %.1f V, k %.1f A/V^2: error %.4f A, up to %.3f A", v_th, k, err,
+		      curve.back().bat_current);
+		err_max = max(err_max, err); cnt_points_max = max(cnt_points_max, (unsigned int)curve.size());
+	}
+	printf("dac scanner: error %.4f A at most, %u points at most\n", err_max, cnt_points_max);
+}
+
+static bool is_monotonic(const vector<DacCurrentPoint>& pts)
+{
+	for (unsigned int i = 1; i < pts.size(); i++)
+		if (pts[i].dac_voltage < pts[i - 1].dac_voltage || pts[i].current < pts[i - 1].current)
+			return false;
+	return true;
+}
+
+// learned points near the curve of the emulated circuit, with noise that makes some of them conflict,
+// keep each table monotonic and within Points_Max. the saved file is loaded into the same table.
+static void test_dac_table()
+{
+	EmuConfig emu_conf; CircuitModel model(emu_conf);
+	mt19937 rng(6);
+	uniform_real_distribution<float> v_dac(emu_conf.mos_v_th, emu_conf.vdda);
+	normal_distribution<float> noise(0, 0.005);
+	const string serial_numbers[] = {"A", "B", "", "0123456789"};
+	
+	DacCurrentTable table;
+	table.prepare("not updated"); //it isn't saved
+	vector<DacScanPoint> curve;
+	for (float v = 0; v <= emu_conf.vdda; v += 0.05)
+		curve.push_back({v, model.current(v), model.v_oc()});
+	table.set_curve("A", curve);
+	check(is_monotonic(table.points("A")) && table.points("A").size() <= DacCurrentTable::Points_Max,
+	      "%u points taken from the curve", (unsigned int)table.points("A").size());
+	
+	unsigned int cnt_checked = 0;
+	for (int n = 0; n < 2000; n++) {
+		const string& sn = serial_numbers[n % 4];
+		float v = v_dac(rng);
+		table.learn(sn, v, max(0.0f, model.current(v) + noise(rng)));
+		const vector<DacCurrentPoint>& pts = table.points(sn);
+		check(is_monotonic(pts) && pts.size() <= DacCurrentTable::Points_Max,
+		      "%u points of \"%s\" after learning %.4f V", (unsigned int)pts.size(), sn.c_str(), v);
+		cnt_checked++;
+	}
+	
+	stringstream sst;
+	check(table.save(sst), "saving the table");
+	string saved = sst.str();
+	DacCurrentTable loaded; sst.seekg(0);
+	check(loaded.load(sst), "loading the saved table");
+	stringstream sst_again; loaded.save(sst_again);
+	check(sst_again.str() == saved, "the loaded table is saved differently");
+	for (const string& sn : serial_numbers)
+		for (float i = 0; i < 1.0; i += 0.01)
+			check(loaded.dac_voltage_for(sn, i) == table.dac_voltage_for(sn, i),
+			      "DAC voltage for %.2f A of \"%s\" after loading", i, sn.c_str());
+	check(loaded.points("not updated").empty(), "a device without points is saved");
+	
+	stringstream truncated(saved.substr(0, saved.size() - 1));
+	check(! loaded.load(truncated), "a truncated table is loaded");
+	printf("dac table: %u points learned, %u bytes saved\n", cnt_checked, (unsigned int)saved.size());
+}
+
+// a stream of bulk frames as the MCU sends them: header, ad_refint (the index of the bulk here)
+// and the readings of cnt_pairs pairs. each frame is preceded by up to garbage_max random bytes,
+// a quarter of the runs begin with a broken header.
+static vector<uint8_t> frame_stream(unsigned int cnt_bulks, uint32_t cnt_pairs, unsigned int garbage_max,
+                                    unsigned int seed)
+{
+	static const uint32_t data_header(Data_Header);
+	mt19937 rng(seed);
+	uniform_int_distribution<unsigned int> run(0, garbage_max), byte(0, 255);
+	vector<uint8_t> s;
+	for (unsigned int b = 0; b < cnt_bulks; b++) {
+		unsigned int l_run = garbage_max? run(rng) : 0;
+		if (l_run > Data_Header_Length && rng() % 4 == 0) {
+			s.insert(s.end(), (const uint8_t*)&data_header, (const uint8_t*)&data_header + Data_Header_Length - 1);
+			l_run -= Data_Header_Length - 1;
+		}
+		for (; l_run > 0; l_run--) s.push_back(byte(rng));
+		
+		uint16_t refint = b;
+		s.insert(s.end(), (const uint8_t*)&data_header, (const uint8_t*)&data_header + Data_Header_Length);
+		s.insert(s.end(), (const uint8_t*)&refint, (const uint8_t*)&refint + sizeof(refint));
+		for (uint32_t i = 0; i < 4 * cnt_pairs; i++) s.push_back(i * 7);
+	}
+	return s;
+}
+
+// a port which gives the stream in reads of at most Read_Max bytes (like the buffer of a tty),
+// each read is counted as a syscall
+struct MemoryPort
+{
+	static const uint32_t Read_Max = 4096;
+	const vector<uint8_t>& s; size_t pos = 0; unsigned long cnt_reads = 0;
+	
+	MemoryPort(const vector<uint8_t>& stream): s(stream) {}
+	uint32_t available() const {return (s.size() - pos > Read_Max)? Read_Max : s.size() - pos;}
+	uint32_t read(void* p, uint32_t sz) {
+		cnt_reads++;
+		if (sz > available()) sz = available();
+		memcpy(p, &s[pos], sz); pos += sz; return sz;
+	}
+	uint32_t read_all(void* p, uint32_t sz) { //like ReadBytes() of serialib
+		uint32_t l = 0, l_rec;
+		while (l < sz && (l_rec = read((uint8_t*)p + l, sz - l)) > 0) l += l_rec;
+		return l;
+	}
+};
+
+// the original rec_until() and rec_data(): a window of the header size is shifted by one byte
+// for each byte read until the header is found, then the frame is read. returns bulks found.
+static unsigned int sync_bytewise(MemoryPort& port, uint32_t sz_payload)
+{
+	static const uint32_t data_header(Data_Header);
+	uint8_t win[Data_Header_Length]; vector<uint8_t> payload(sizeof(uint16_t) + sz_payload);
+	unsigned int cnt_found = 0; uint16_t refint_exp = 0;
+	while (port.read_all(win, Data_Header_Length) == Data_Header_Length) {
+		while (memcmp(win, &data_header, Data_Header_Length) != 0) {
+			memmove(win, win + 1, Data_Header_Length - 1);
+			if (port.read(&win[Data_Header_Length - 1], 1) != 1) return cnt_found;
+		}
+		if (port.read_all(payload.data(), payload.size()) != payload.size()) break;
+		uint16_t refint; memcpy(&refint, payload.data(), sizeof(refint));
+		if (refint >= refint_exp) cnt_found++;
+		refint_exp = refint + 1;
+	}
+	return cnt_found;
+}
+
+// rec_until() and rec_data() with RecvBuffer: everything available is read at once, the header
+// is found by RecvBuffer::find(), and the frame is parsed in place
+static unsigned int sync_buffered(MemoryPort& port, uint32_t sz_payload)
+{
+	static const uint32_t data_header(Data_Header);
+	uint32_t sz_frame = Data_Header_Length + sizeof(uint16_t) + sz_payload;
+	RecvBuffer buf; buf.reserve(2 * sz_frame);
+	auto fill = [&](uint32_t sz_data) -> bool {
+		while (buf.size() < sz_data) {
+			uint32_t sz_space; uint8_t* p = buf.space(&sz_space);
+			uint32_t sz_read = sz_data - buf.size();
+			if (port.available() > sz_read) sz_read = port.available();
+			if (sz_read > sz_space) sz_read = sz_space;
+			uint32_t l_rec = port.read(p, sz_read);
+			if (l_rec == 0) return false;
+			buf.commit(l_rec);
+		}
+		return true;
+	};
+	
+	unsigned int cnt_found = 0; uint16_t refint_exp = 0;
+	while (true) {
+		buf.consume(buf.find((const uint8_t*)&data_header, Data_Header_Length));
+		if (buf.size() < Data_Header_Length) {
+			if (! fill(Data_Header_Length)) break;
+			continue;
+		}
+		if (! fill(sz_frame)) break;
+		uint16_t refint; memcpy(&refint, buf.data() + Data_Header_Length, sizeof(refint));
+		if (refint >= refint_exp) cnt_found++;
+		refint_exp = refint + 1;
+		buf.consume(sz_frame);
+	}
+	return cnt_found;
+}
+
+// both ways of synchronization find every bulk behind the garbage
+static void test_frame_sync()
+{
+	const uint32_t cnt_pairs = 3072;
+	const unsigned int garbage_max[] = {0, 16, 3000, 20000};
+	for (unsigned int g : garbage_max) {
+		vector<uint8_t> s = frame_stream(50, cnt_pairs, g, 5);
+		MemoryPort port1(s), port2(s);
+		unsigned int cnt1 = sync_bytewise(port1, 4 * cnt_pairs), cnt2 = sync_buffered(port2, 4 * cnt_pairs);
+		check(cnt1 == 50 && cnt2 == 50, "frame sync with up to %u garbage bytes: %u (bytewise), "
+		      "%u (buffered) of 50 bulks found", g, cnt1, cnt2);
+	}
+	printf("frame sync: checked\n");
+}
+
+// receives 200 bulks of 3072 pairs, with up to 0 ~ 20000 garbage bytes before each bulk
+static void bench_frame_sync()
+{
+	const uint32_t cnt_pairs = 3072; const unsigned int cnt_bulks = 200;
+	const unsigned int garbage_max[] = {0, 64, 3000, 20000};
+	for (unsigned int g : garbage_max) {
+		vector<uint8_t> s = frame_stream(cnt_bulks, cnt_pairs, g, 6);
+		for (int buffered = 0; buffered < 2; buffered++) {
+			MemoryPort port(s); unsigned int cnt_found;
+			steady_clock::time_point t = steady_clock::now();
+			if (buffered) cnt_found = sync_buffered(port, 4 * cnt_pairs);
+			else          cnt_found = sync_bytewise(port, 4 * cnt_pairs);
+			double sec = duration_cast<nanoseconds>(steady_clock::now() - t).count() / 1e9;
+			printf("frame sync (%s), garbage up to %5u bytes: %7.1f MB/s, %7lu reads, %u of %u bulks\n",
+			       buffered? "buffered" : "bytewise", g, s.size() / sec / 1e6, port.cnt_reads, cnt_found, cnt_bulks);
+		}
+	}
+}
+
+// SimTransport which records the bytes in the format of CaptureTransport, so a capture
+// is made without the hardware
+class RecordingSimTransport: public SimTransport
+{
+	ClockSource* clock; ofstream ofs;
+	steady_clock::time_point t_last;
+	
+	void record(uint8_t dir, const void* data, uint32_t sz);
+
+public:
+	RecordingSimTransport(ClockSource* clock, const EmuConfig& conf, const string& path);
+	bool write(const void* data, uint32_t sz) override;
+	int read(void* buf, uint32_t sz, uint32_t timeout_ms) override;
+};
+
+RecordingSimTransport::RecordingSimTransport(ClockSource* clock, const EmuConfig& conf, const string& path):
+	SimTransport(clock, conf), clock(clock), ofs(path, ios::binary | ios::trunc), t_last(clock->now())
+{
+	ofs.write(Capture_Magic, sizeof(Capture_Magic));
+}
+
+bool RecordingSimTransport::write(const void* data, uint32_t sz)
+{
+	record(Capture_Dir_Sent, data, sz);
+	return SimTransport::write(data, sz);
+}
+
+int RecordingSimTransport::read(void* buf, uint32_t sz, uint32_t timeout_ms)
+{
+	int r = SimTransport::read(buf, sz, timeout_ms);
+	if (r > 0) record(Capture_Dir_Received, buf, r);
+	return r;
+}
+
+void RecordingSimTransport::record(uint8_t dir, const void* data, uint32_t sz)
+{
+	steady_clock::time_point t = clock->now();
+	uint32_t dt_us = duration_cast<microseconds>(t - t_last).count();
+	t_last = t;
+	
+	const uint8_t* p = (const uint8_t*) data;
+	while (sz > 0) {
+		uint16_t len = (sz > UINT16_MAX)? UINT16_MAX : sz;
+		ofs.write((const char*)&dt_us, sizeof(dt_us));
+		ofs.write((const char*)&dir, sizeof(dir));
+		ofs.write((const char*)&len, sizeof(len));
+		ofs.write((const char*)p, len);
+		p += len; sz -= len; dt_us = 0;
+	}
+}
+
+struct BulkCounter
+{
+	unsigned int cnt = 0;
+	void data_callback(float u1, float u2) {cnt++;}
+};
+
+// records the bytes of a connection to the emulated device on a virtual clock, until cnt_bulks are received
+static CommStatistics record_capture(const char* path, const EmuConfig& emu_conf, uint8_t data_format,
+                                     unsigned int cnt_bulks)
+{
+	VirtualClock clock; clock.add_thread();
+	CommLayer* comm = new CommLayer(&clock, new RecordingSimTransport(&clock, emu_conf, path));
+	comm->set_data_format(data_format);
+	BulkCounter counter;
+	bool connected = comm->connect(MemberFuncDataCallbackPtr<BulkCounter, &BulkCounter::data_callback>(&counter));
+	check(connected, "connection to the emulated device");
+	for (unsigned int i = 0; connected && i < 100 * cnt_bulks && counter.cnt < cnt_bulks; i++)
+		clock.sleep_for(milliseconds(100));
+	comm->disconnect();
+	CommStatistics st = comm->comm_statistics(); //of all the bulks recorded
+	delete comm; //the capture is closed with the transport
+	clock.remove_thread();
+	return st;
+}
+
+// replays the capture at full speed until cnt_bulks are received, or nothing is received in a while.
+// the data format must be the one asked for while recording.
+static CommStatistics replay_capture(const char* path, uint8_t data_format, unsigned long cnt_bulks)
+{
+	steady_clock::time_point t_last = steady_clock::now();
+	CommLayer* comm = new CommLayer(NULL, new ReplayTransport(path, true));
+	comm->set_data_format(data_format);
+	BulkCounter counter;
+	bool connected = comm->connect(MemberFuncDataCallbackPtr<BulkCounter, &BulkCounter::data_callback>(&counter));
+	check(connected, "connection to the replayed capture");
+	
+	CommStatistics st; unsigned long long cnt_last = 0;
+	while (connected && steady_clock::now() - t_last < milliseconds(300)) {
+		st = comm->comm_statistics();
+		unsigned long long cnt = st.cnt_bulks_received + st.cnt_resyncs + st.cnt_bytes_skipped;
+		if (cnt != cnt_last) {
+			cnt_last = cnt; t_last = steady_clock::now();
+		}
+		if (st.cnt_bulks_received >= cnt_bulks) break;
+		this_thread::sleep_for(microseconds(100));
+	}
+	delete comm;
+	return st;
+}
+
+// bulks in the packed formats (negotiated by Cmd_ID_ADC_Config) are recorded, then the capture
+// is replayed. all complete bulks should be received again.
+static void test_replay()
+{
+	const char* path = "usb_charge_test.cap";
+	const struct {uint8_t format; const char* name; float bytes_max;} formats[] = //bytes per reading, 4 if raw
+		{{Data_Format_Packed, "packed", 3.5}, {Data_Format_Delta, "delta", 2.0}};
+	for (auto& f : formats) {
+		EmuConfig emu_conf; //Capability_Data_Packed is given
+		CommStatistics st_rec = record_capture(path, emu_conf, f.format, 20);
+		check(st_rec.cnt_bulks_received >= 20, "%lu bulks recorded", st_rec.cnt_bulks_received);
+		check(st_rec.cnt_data_bytes < f.bytes_max * st_rec.cnt_data_readings,
+		      "%llu bytes for %llu readings, not the %s format", st_rec.cnt_data_bytes,
+		      st_rec.cnt_data_readings, f.name);
+		
+		CommStatistics st = replay_capture(path, f.format, st_rec.cnt_bulks_received);
+		remove(path);
+		check(st.cnt_bulks_received >= st_rec.cnt_bulks_received && st.cnt_resyncs == 0,
+		      "%lu bulks replayed (%lu resyncs), %lu recorded", st.cnt_bulks_received, st.cnt_resyncs,
+		      st_rec.cnt_bulks_received);
+		printf("replay: %lu bulks in the %s format, %.2f bytes per reading\n", st.cnt_bulks_received,
+		       f.name, (float)st_rec.cnt_data_bytes / st_rec.cnt_data_readings);
+	}
+}
+
+struct VoltageRange
+{
+	unsigned int cnt = 0; float u_min = 1e9, u_max = -1e9;
+	void data_callback(float u1, float u2) {
+		cnt++; u_min = min(u_min, min(u1, u2)); u_max = max(u_max, max(u1, u2));
+	}
+};
+
+// the bulk buffers should hold the default and the lengthened bulks, even if the longest amount
+// is not a whole number of chunks or the default amount is not lengthened
+static void test_bulk_sizes()
+{
+	const uint16_t amounts[][2] = {{3000, 3000}, {200, 200}, {200, 4096}, {3072, 4 * 3072}};
+	const CommBulkMode modes[] = {Bulk_Default, Bulk_Long, Bulk_Short, Bulk_Default};
+	for (auto& a : amounts) {
+		EmuConfig emu_conf; emu_conf.bulk_data_amount = a[0]; emu_conf.bulk_data_amount_max = a[1];
+		VirtualClock clock; clock.add_thread();
+		CommLayer* comm = new CommLayer(&clock, new SimTransport(&clock, emu_conf));
+		VoltageRange range;
+		bool connected = comm->connect(MemberFuncDataCallbackPtr<VoltageRange, &VoltageRange::data_callback>(&range));
+		check(connected, "connection with bulks of %u (%u at most)", a[0], a[1]);
+		for (CommBulkMode mode : modes) {
+			comm->set_bulk_mode(mode);
+			unsigned int cnt = range.cnt + 5;
+			for (unsigned int i = 0; connected && i < 1000 && range.cnt < cnt; i++)
+				clock.sleep_for(milliseconds(100));
+		}
+		comm->disconnect();
+		delete comm;
+		clock.remove_thread();
+		
+		check(range.cnt >= 4 * 5, "%u bulks received with bulks of %u (%u at most)", range.cnt, a[0], a[1]);
+		check(range.u_min >= 0 && range.u_max <= emu_conf.vdda,
+		      "voltages %.3f ~ %.3f V with bulks of %u (%u at most)", range.u_min, range.u_max, a[0], a[1]);
+	}
+	printf("bulk sizes: %u configurations\n", (unsigned int)(sizeof(amounts) / sizeof(amounts[0])));
+}
+
+
+struct CurrentProbe
+{
+	float r_samp; unsigned int cnt = 0; float current = 0;
+	CurrentProbe(float r_samp): r_samp(r_samp) {}
+	void data_callback(float u1, float u2) {cnt++; current = u2 / r_samp;}
+};
+
+// an over-current on the emulated device disables the output from the receiving thread, and the DAC
+// output is refused until the trip is taken
+static void test_trip()
+{
+	EmuConfig emu_conf;
+	VirtualClock clock; clock.add_thread();
+	CommLayer* comm = new CommLayer(&clock, new SimTransport(&clock, emu_conf));
+	TripLimits limits; limits.r_samp = emu_conf.r_samp; limits.div_prop = emu_conf.div_prop;
+	limits.i_max = 0.5;
+	comm->set_trip_limits(limits);
+	
+	CurrentProbe probe(emu_conf.r_samp);
+	bool connected = comm->connect(MemberFuncDataCallbackPtr<CurrentProbe, &CurrentProbe::data_callback>(&probe));
+	check(connected, "connection to the emulated device");
+	auto wait_bulks = [&](unsigned int cnt_bulks, function<bool()> cond) {
+		unsigned int cnt = probe.cnt + cnt_bulks;
+		for (unsigned int i = 0; connected && i < 1000 && probe.cnt < cnt && !cond(); i++)
+			clock.sleep_for(milliseconds(10));
+	};
+	wait_bulks(2, [] {return false;});
+	
+	check(comm->dac_output(2.5), "DAC output before the trip"); //above 1 A
+	wait_bulks(20, [comm] {return comm->comm_statistics().cnt_trips > 0;});
+	wait_bulks(3, [] {return false;}); //the bulk being sent while tripping may still have the current
+	CommStatistics st = comm->comm_statistics();
+	check(st.cnt_trips > 0, "no trip at %.3f A", probe.current);
+	check(probe.current < 0.02, "output is not disabled after the trip, %.3f A", probe.current);
+	check(! comm->dac_output(1.0), "DAC output is not refused after the trip");
+	check(comm->take_trip() && ! comm->take_trip(), "the trip is not taken once");
+	check(comm->dac_output(0), "DAC output after the trip is taken");
+	
+	comm->disconnect();
+	delete comm;
+	clock.remove_thread();
+	printf("trip: %lu trips, latency %.1f ms (simulated)\n", st.cnt_trips, st.trip_latency.average_us() / 1000);
+}
+
+
+// measures the time for each bulk of 3072 pairs, averaged in chunks of 128
+template <typename Func>
+static double bench_bulks(const vector<uint16_t>& bulks, unsigned int cnt_bulks, Func func)
+{
+	const unsigned int amount = 3072, chunk = 128;
+	float av1, av2, acc = 0;
+	steady_clock::time_point t = steady_clock::now();
+	for (unsigned int b = 0; b < cnt_bulks; b++)
+		for (unsigned int i = 0; i < amount; i += chunk) {
+			func(&bulks[2 * (b * amount + i)], chunk, 8, &av1, &av2);
+			acc += av1 + av2;
+		}
+	double us = duration_cast<nanoseconds>(steady_clock::now() - t).count() / 1000.0;
+	if (acc == -1) printf(" "); //keeps the results
+	return us / cnt_bulks;
+}
+
+static void bench_stable_average()
+{
+	const unsigned int amount = 3072, cnt_bulks = 200;
+	vector<uint16_t> bulks(2 * amount * cnt_bulks);
+	const float noises[] = {2, 40};
+	for (float noise : noises) {
+		SyntheticData gen(2);
+		gen.fill(bulks.data(), amount * cnt_bulks, noise, 0.01);
+		void (*func)(const uint16_t*, unsigned int, float, float*, float*) = get_stable_averages;
+		double us_orig = bench_bulks(bulks, cnt_bulks / 10, get_stable_averages_orig),
+		       us_hist = bench_bulks(bulks, cnt_bulks, func);
+		printf("stable average, noise %2.0f LSB: %8.1f us per bulk (original), %6.1f us (histogram)\n",
+		       noise, us_orig, us_hist);
+	}
+}
+
+// the pass over a bulk of 3072 pairs, in chunks of 128
+static void bench_pair_stats()
+{
+	const unsigned int amount = 3072, chunk = 128, cnt_bulks = 2000;
+	vector<uint16_t> bulk(2 * amount);
+	SyntheticData gen(3); gen.fill(bulk.data(), amount, 2, 0);
+	
+	for (const PairStatsPath& path : pair_stats_paths()) {
+		PairStats st; uint64_t acc = 0;
+		steady_clock::time_point t = steady_clock::now();
+		for (unsigned int b = 0; b < cnt_bulks; b++)
+			for (unsigned int i = 0; i < amount; i += chunk) {
+				path.func(&bulk[2 * i], chunk, &st); acc += st.sum_sq[0];
+			}
+		double us = duration_cast<nanoseconds>(steady_clock::now() - t).count() / 1000.0 / cnt_bulks;
+		if (acc == 1) printf(" "); //keeps the results
+		printf("pair stats (%s): %.2f us per bulk\n", path.name, us);
+	}
+}
+
+#ifdef __linux__
+// a pseudo terminal standing in for a port. a responsive one is served by an emulated device
+// in its own thread, an unresponsive one never answers.
+class PtyStandIn
+{
+	EmuDevice dev; int fd = -1; string path;
+	thread* th = NULL; volatile bool flag_close = false;
+	
+	void serve();
+
+public:
+	PtyStandIn(bool responsive);
+	~PtyStandIn();
+	const string& name() const {return path;}
+};
+
+PtyStandIn::PtyStandIn(bool responsive): dev(EmuConfig(), 1)
+{
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) return;
+	path = ptsname(fd);
+	termios tio;
+	if (tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio); tcsetattr(fd, TCSANOW, &tio);
+	}
+	if (responsive) th = new thread(&PtyStandIn::serve, this);
+}
+
+PtyStandIn::~PtyStandIn()
+{
+	flag_close = true;
+	if (th) {
+		th->join(); delete th;
+	}
+	if (fd >= 0) close(fd);
+}
+
+void PtyStandIn::serve()
+{
+	while (! flag_close) {
+		pollfd pfd = {fd, POLLIN, 0};
+		int r = poll(&pfd, 1, 20);
+		if (r > 0 && (pfd.revents & POLLHUP)) { //the port is not opened
+			this_thread::sleep_for(milliseconds(1)); continue;
+		}
+		if (r <= 0 || !(pfd.revents & POLLIN)) continue;
+		
+		uint8_t buf[256];
+		ssize_t l = read(fd, buf, sizeof(buf));
+		if (l <= 0) continue;
+		dev.receive_stream(buf, l, steady_clock::now());
+		vector<uint8_t>& out = dev.output();
+		for (size_t pos = 0; pos < out.size();) {
+			ssize_t w = write(fd, out.data() + pos, out.size() - pos);
+			if (w <= 0) break;
+			pos += w;
+		}
+		out.clear();
+	}
+}
+
+// CommLayer::probe_ports() on ptys, the responsive and the unresponsive ones are mixed
+static void bench_probe_ports()
+{
+	const unsigned int cnt_ports = 8;
+	vector<PtyStandIn*> ptys; vector<string> names, names_responsive;
+	for (unsigned int i = 0; i < cnt_ports; i++) {
+		ptys.push_back(new PtyStandIn(i % 2 == 0));
+		names.push_back(ptys.back()->name());
+		if (i % 2 == 0) names_responsive.push_back(names.back());
+	}
+	
+	auto probe = [](const vector<string>& names, unsigned int cnt_threads, unsigned int* cnt_responsive) {
+		steady_clock::time_point t = steady_clock::now();
+		vector<char> responsive = CommLayer::probe_ports(names, cnt_threads);
+		double ms = duration_cast<microseconds>(steady_clock::now() - t).count() / 1000.0;
+		*cnt_responsive = count(responsive.begin(), responsive.end(), true);
+		return ms;
+	};
+	unsigned int cnt_1, cnt_2, cnt_3;
+	double ms_round_trip = probe(names_responsive, 1, &cnt_1) / names_responsive.size(),
+	       ms_seq = probe(names, 1, &cnt_2), ms_conc = probe(names, cnt_ports, &cnt_3);
+	printf("probe of a responsive pty: %.2f ms\n", ms_round_trip);
+	printf("probe of %u ptys (%u responsive): %.1f ms one by one (%u found), %.1f ms concurrently (%u found)\n",
+	       cnt_ports, (unsigned int)names_responsive.size(), ms_seq, cnt_2, ms_conc, cnt_3);
+	
+	for (PtyStandIn* pty : ptys) delete pty;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	bool bench = argc > 1 && string(argv[1]) == "--bench";
+	if (bench) {
+		bench_stable_average();
+		bench_pair_stats();
+		bench_frame_sync();
+	#ifdef __linux__
+		bench_probe_ports();
+	#endif
+		return 0;
+	}
+	
+	test_stable_average();
+	test_pair_stats();
+	test_codec();
+	test_windowed_stats();
+	test_dac_scanner();
+	test_dac_table();
+	test_frame_sync();
+	test_replay();
+	test_bulk_sizes();
+	test_trip();
+	if (cnt_failed) printf("%u checks failed\n", cnt_failed);
+	else printf("all checks passed\n");
+	return cnt_failed? 1 : 0;
+}
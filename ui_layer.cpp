@@ -6,6 +6,7 @@
 #include <ctime>
 #include <chrono>
 #include <iomanip>
+#include <fstream>
 
 #include <glibmm/timer.h>
 #include <glibmm/stringutils.h>
@@ -457,7 +458,8 @@ bool UILayer::open_file(Recorder* recorder)
 	return recorder->open_csv(path);
 }
 
-bool UILayer::save_as_file(Recorder* recorder, const string& file_name_default, const string& comment)
+// returns the path with .csv suffix, or an empty string if it's cancelled
+string UILayer::choose_file_to_save(const string& file_name_default)
 {
 	using Glib::str_has_suffix;
 	#ifdef _WIN32
@@ -473,23 +475,50 @@ bool UILayer::save_as_file(Recorder* recorder, const string& file_name_default,
 	Gtk::ResponseType resp = (Gtk::ResponseType)
 		this->file_dialog->run();
 	this->file_dialog->hide(); this->file_dialog->close();
-	if (resp != Gtk::RESPONSE_OK) return false;
+	if (resp != Gtk::RESPONSE_OK) return "";
 	
 	string path = this->file_dialog->get_current_folder();
 	if (! str_has_suffix(path, Slash)) path += Slash;
 	path += this->file_dialog->get_current_name();
 	if (! str_has_suffix(path, ".csv")) path += ".csv"; 
+	return path;
+}
+
+void UILayer::show_save_failure()
+{
+	Gtk::MessageDialog msg_dlg(*this->window, locale_str.message_failed_to_save_file, 
+	                           false, Gtk::MESSAGE_ERROR, Gtk::BUTTONS_OK, true);
+	msg_dlg.run(); msg_dlg.close();
+}
+
+bool UILayer::save_as_file(Recorder* recorder, const string& file_name_default, const string& comment)
+{
+	string path = choose_file_to_save(file_name_default);
+	if (path.empty()) return false;
 	
 	if (recorder->is_recording())
 		recorder->stop();
 	bool suc = recorder->save_csv(path, comment);
 	
-	if (! suc) {
-		Gtk::MessageDialog msg_dlg(*this->window, locale_str.message_failed_to_save_file, 
-	                               false, Gtk::MESSAGE_ERROR, Gtk::BUTTONS_OK, true);
-	    msg_dlg.run(); msg_dlg.close();
+	if (! suc) show_save_failure();
+	return suc;
+}
+
+// the measured points of the scan, sorted by the DAC voltage
+bool UILayer::save_dac_scan_curve(const string& file_name_default)
+{
+	string path = choose_file_to_save(file_name_default);
+	if (path.empty()) return false;
+	
+	ofstream ofs(path, ios::trunc);
+	if (ofs) {
+		ofs << "dac_voltage,bat_current,bat_voltage\n" << fixed << setprecision(4);
+		for (const DacScanPoint& pt : this->ctrl->dac_scan_curve())
+			ofs << pt.dac_voltage << ',' << pt.bat_current << ',' << pt.bat_voltage << '\n';
 	}
+	bool suc = (bool) ofs;
 	
+	if (! suc) show_save_failure();
 	return suc;
 }
 
@@ -646,7 +675,7 @@ void UILayer::dac_scan(Gtk::Window& parent_window)
 			const time_t t_c = system_clock::to_time_t(system_clock::now());
 			sst.clear(); sst.str("");
 			sst << put_time(localtime(&t_c), "%Y_%m_%d_%H_%M_%S");
-			save_as_file(rec_dac_scan, "DAC_Scan_" + sst.str(), "--------------------------------");
+			save_dac_scan_curve("DAC_Scan_" + sst.str());
 		}
 		else break;
 	}
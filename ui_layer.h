@@ -85,7 +85,10 @@ class UILayer: public sigc::trackable
 	void show_param_values();
 	
 	bool open_file(SimpleCairoPlot::Recorder* recorder);
+	string choose_file_to_save(const string& file_name_default);
+	void show_save_failure();
 	bool save_as_file(SimpleCairoPlot::Recorder* recorder, const string& file_name_default, const string& comment);
+	bool save_dac_scan_curve(const string& file_name_default);
 	void dac_scan(Gtk::Window& parent_window);
 	
 	void close_window();
@@ -213,7 +213,15 @@ void Locale::get_control_status_str(const ChargeStatus& st, Glib::ustring& str)
 		<< "IMax: " << setprecision(0) << st.bat_current_max * 1000.0 << " mA" << endl << endl;
 	
 	if (st.flag_ir_measured)
-		sst << "r (DC): " << setprecision(0) << st.ir * 1000.0 << " mOhm" << endl << endl;
+		sst << "r (DC): " << setprecision(0) << st.ir * 1000.0 << " mOhm" << endl
+		    << "r: " << st.cnt_ir_measure << " times, " << setprecision(1) << st.t_ir_lost << " s lost"
+		    << endl << endl;
+	
+	if (st.t_settling >= 0)
+		sst << "Settled: " << setprecision(1) << st.t_settling << " s" << endl;
+	if (st.i_overshoot > 0)
+		sst << "Overshoot: " << setprecision(0) << st.i_overshoot * 1000.0 << " mA" << endl;
+	if (st.t_settling >= 0 || st.i_overshoot > 0) sst << endl;
 	
 	sst << st.t_charge_start << " " << setprecision(3) << st.bat_voltage_initial << " V" << endl;
 	if (st.control_state == Charge_Completed || st.control_state == Charge_Stopped)
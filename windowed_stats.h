@@ -0,0 +1,101 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+
+#ifndef WINDOWED_STATS_H
+#define WINDOWED_STATS_H
+
+#include <cmath>
+
+// statistics of the latest N values. the sums are updated for each value, and the minimum
+// and the maximum are kept by monotonic queues of positions, so both the update and the
+// queries take constant time. it doesn't allocate.
+template <typename T, unsigned int N>
+class WindowedStats
+{
+	T vals[N]; //circular
+	unsigned int cnt_pushed = 0, cnt = 0; //the position of a value is cnt_pushed when it's pushed
+	
+	// differences from the first value after clearing are summed, for the precision of variance
+	double offset = 0, sum = 0, sum_sq = 0;
+	
+	// positions of values rising from the front of q_min, or falling from the front of q_max.
+	// the front is the minimum (or maximum), a position leaves the front when it's out of the window.
+	unsigned int q_min[N], q_max[N]; //circular
+	unsigned int q_min_begin = 0, q_min_cnt = 0, q_max_begin = 0, q_max_cnt = 0;
+	
+	template <typename Comp>
+	void queue_push(unsigned int* q, unsigned int& begin, unsigned int& cnt_q, T val, Comp before);
+
+public:
+	void push(T val);
+	void clear();
+	
+	unsigned int count() const {return cnt;}
+	unsigned int size() const {return N;}
+	bool is_full() const {return cnt == N;}
+	
+	// 0 is returned if it's empty
+	T get_average() const;
+	T get_variance() const; //of the values in the window, not an estimate of the population
+	T get_stddev() const {return sqrt(get_variance());}
+	T get_min() const {return q_min_cnt? vals[q_min[q_min_begin] % N] : 0;}
+	T get_max() const {return q_max_cnt? vals[q_max[q_max_begin] % N] : 0;}
+};
+
+template <typename T, unsigned int N>
+inline void WindowedStats<T, N>::push(T val)
+{
+	if (cnt == 0) offset = val;
+	unsigned int pos = cnt_pushed++;
+	if (cnt == N) {
+		double d_old = vals[pos % N] - offset;
+		sum -= d_old; sum_sq -= d_old * d_old;
+	} else
+		cnt++;
+	
+	// the old value is still in vals[] while the queues are checked
+	queue_push(q_min, q_min_begin, q_min_cnt, val, [](T a, T b) {return a < b;});
+	queue_push(q_max, q_max_begin, q_max_cnt, val, [](T a, T b) {return a > b;});
+	vals[pos % N] = val;
+	
+	double d = val - offset;
+	sum += d; sum_sq += d * d;
+}
+
+template <typename T, unsigned int N>
+template <typename Comp>
+inline void WindowedStats<T, N>::queue_push(unsigned int* q, unsigned int& begin, unsigned int& cnt_q,
+                                            T val, Comp before)
+{
+	unsigned int pos = cnt_pushed - 1; //of the new value
+	while (cnt_q && pos - q[begin] >= N) { //out of the window
+		begin = (begin + 1) % N; cnt_q--;
+	}
+	while (cnt_q && ! before(vals[q[(begin + cnt_q - 1) % N] % N], val))
+		cnt_q--;
+	q[(begin + cnt_q) % N] = pos; cnt_q++;
+}
+
+template <typename T, unsigned int N>
+inline void WindowedStats<T, N>::clear()
+{
+	cnt = 0; sum = sum_sq = 0;
+	q_min_cnt = q_max_cnt = 0;
+}
+
+template <typename T, unsigned int N>
+inline T WindowedStats<T, N>::get_average() const
+{
+	if (cnt == 0) return 0;
+	return offset + sum / cnt;
+}
+
+template <typename T, unsigned int N>
+inline T WindowedStats<T, N>::get_variance() const
+{
+	if (cnt == 0) return 0;
+	double av = sum / cnt, var = sum_sq / cnt - av * av;
+	return (var > 0)? var : 0; //it may be slightly negative by the rounding
+}
+
+#endif